@@ -38,6 +38,16 @@
 #include <util/delay.h>
 
 #include "bootloaderconfig.h"
+#if (defined(ENABLE_LOW_POWER_IDLE) || defined(ENABLE_USB_SUSPEND)) && !defined(ENABLE_TIMER0_TIMEBASE)
+#define ENABLE_TIMER0_TIMEBASE // the idle timeouts can not be counted in loops if the system clock changes
+#endif
+#if defined(ENABLE_TRACE) && !defined(ENABLE_TIMER0_TIMEBASE)
+#define ENABLE_TIMER0_TIMEBASE // the trace time stamps are Timer0 ticks, see usbdrv/oddebug.h
+#endif
+#if defined(ENABLE_INTERLEAVED_ERASE) || defined(ENABLE_DIAGNOSTICS) || defined(ENABLE_TRACE) || defined(ENABLE_SERIAL_NUMBER) \
+        || defined(ENABLE_BOOTLOADER_HASH)
+#define MNHACK_RAM_MSGPTR // status, diagnostics, trace, serial number and hash replies are read from RAM, see usbdrv.c
+#endif
 #include "usbdrv/usbdrv.c"
 
 // Microcontroller vector table entries in the flash
@@ -90,12 +100,65 @@
 //    Bit 7 '1': Page erase time equals page write time divided by 4
 //   Byte 4:  SIGNATURE_1
 //   Byte 5:  SIGNATURE_2
+// Optional byte, only appended if one of the features below is enabled. Host tools requesting 6 bytes are not affected.
+//   Byte 6:  Feature flags
+//    Bit 0 '1': Frame aligned SPM. Page erase and page write start directly after the next keep-alive,
+//               so the CPU halt has ended before the start of frame (request frame + 1 + page write time in ms).
+//    Bit 1 '1': Interleaved erase. The device answers requests while erasing and cmd_get_status returns
+//               the number of pages still to erase. Polls hitting an erase halt are lost and must be repeated.
+//    Bit 2 '1': Diagnostics. cmd_get_diagnostics returns the counters of usbDiagnostics.
+//    Bit 3 '1': Trace. cmd_get_trace returns the trace buffer odTraceBuffer, see usbdrv/oddebug.h.
+//    Bit 4 '1': Serial number. The string descriptor 3 is the unique serial number of the chip.
+//    Bit 5 '1': Bootloader hash. cmd_get_bootloader_hash returns the CRC-32 of the bootloader and the configuration identifier.
+//    Bit 6 '1': Self update. cmd_self_update replaces the bootloader by the one staged in the application area.
+
+#if defined(ENABLE_FRAME_ALIGNED_SPM)
+#define FEATURE_FRAME_ALIGNED_SPM   0x01
+#else
+#define FEATURE_FRAME_ALIGNED_SPM   0
+#endif
+#if defined(ENABLE_INTERLEAVED_ERASE)
+#define FEATURE_INTERLEAVED_ERASE   0x02
+#else
+#define FEATURE_INTERLEAVED_ERASE   0
+#endif
+#if defined(ENABLE_DIAGNOSTICS)
+#define FEATURE_DIAGNOSTICS         0x04
+#else
+#define FEATURE_DIAGNOSTICS         0
+#endif
+#if defined(ENABLE_TRACE)
+#define FEATURE_TRACE               0x08
+#else
+#define FEATURE_TRACE               0
+#endif
+#if defined(ENABLE_SERIAL_NUMBER)
+#define FEATURE_SERIAL_NUMBER       0x10
+#else
+#define FEATURE_SERIAL_NUMBER       0
+#endif
+#if defined(ENABLE_BOOTLOADER_HASH)
+#define FEATURE_BOOTLOADER_HASH     0x20
+#else
+#define FEATURE_BOOTLOADER_HASH     0
+#endif
+#if defined(ENABLE_SELF_UPDATE)
+#define FEATURE_SELF_UPDATE         0x40
+#else
+#define FEATURE_SELF_UPDATE         0
+#endif
+#define MICRONUCLEUS_FEATURES (FEATURE_FRAME_ALIGNED_SPM | FEATURE_INTERLEAVED_ERASE | FEATURE_DIAGNOSTICS | FEATURE_TRACE \
+        | FEATURE_SERIAL_NUMBER | FEATURE_BOOTLOADER_HASH | FEATURE_SELF_UPDATE)
 
-PROGMEM const uint8_t configurationReply[6] = { (((uint16_t) PROGMEM_SIZE) >> 8) & 0xff, ((uint16_t) PROGMEM_SIZE) & 0xff,
+PROGMEM const uint8_t configurationReply[] = { (((uint16_t) PROGMEM_SIZE) >> 8) & 0xff, ((uint16_t) PROGMEM_SIZE) & 0xff,
 SPM_PAGESIZE,
 MICRONUCLEUS_WRITE_SLEEP,
 SIGNATURE_1,
-SIGNATURE_2 };
+SIGNATURE_2
+#if MICRONUCLEUS_FEATURES
+, MICRONUCLEUS_FEATURES
+#endif
+};
 
 typedef union {
     uint16_t w;
@@ -109,6 +172,49 @@ typedef union {
 register uint16_union_t currentAddress asm("r4");  // r4/r5 current progmem address, used for erasing and writing
 register uint16_union_t idlePolls asm("r6");  // r6/r7 idle counter - each tick is 5 milliseconds
 
+#if defined(ENABLE_TIMER0_TIMEBASE)
+/*
+ * Timer0 runs with F_CPU / 1024 and idlePolls is incremented for each 5 ms elapsed, independent of USB traffic.
+ * It wraps around after 256 ticks (16 ms at 16.5 MHz), so a blocking erase is not accounted for.
+ */
+#  if defined(__AVR_ATtiny88__)
+#define TIMER0_CLOCK_SELECT_REGISTER TCCR0A // ATtiny88 has the clock select bits in TCCR0A
+#  else
+#define TIMER0_CLOCK_SELECT_REGISTER TCCR0B
+#  endif
+#  if defined(TIFR0)
+#define TIMER0_FLAG_REGISTER TIFR0
+#  else
+#define TIMER0_FLAG_REGISTER TIFR // shared with Timer1 on the ATtiny25/45/85
+#  endif
+#  if defined(OCF0B)
+#define TIMER0_FLAGS (_BV(OCF0B) | _BV(OCF0A) | _BV(TOV0))
+#  else
+#define TIMER0_FLAGS (_BV(OCF0A) | _BV(TOV0)) // ATtiny167 has only one compare unit for Timer0
+#  endif
+#define TIMER0_CLOCK_SELECT_1024 (_BV(CS02) | _BV(CS00)) // F_CPU / 1024
+#define IDLE_POLL_TICKS ((uint8_t) (F_CPU / 1024.0 * 5.0 / 1000.0 + 0.5)) // Timer0 ticks per 5 ms
+// The wait loop for USB ends before the 5 ms period of Timer0, so the main loop sees every period and counts it
+#define WAIT_LOOP_MS    4.0f
+// The timer keeps the time, so we can reset the whole counter to start an exact new timeout
+#define resetIdlePolls() (idlePolls.w = 0)
+#else
+// Reset only the high byte, this saves 2 bytes but the new timeout may be up to 1.28 seconds shorter
+#define resetIdlePolls() (idlePolls.b[1] = 0)
+#define WAIT_LOOP_MS    5.0f
+#endif
+
+#if defined(ENABLE_LOW_POWER_IDLE)
+#define LOW_POWER_CLOCK_DIVISION_BITS   _BV(CLKPS2)             // F_CPU / 16
+#define LOW_POWER_TIMER0_CLOCK_SELECT   (_BV(CS01) | _BV(CS00)) // F_CPU / 16 / 64 gives the same time base as F_CPU / 1024
+#endif
+#if defined(ENABLE_USB_SUSPEND)
+#define SUSPEND_CLOCK_DIVISION_BITS     (_BV(CLKPS2) | _BV(CLKPS1) | _BV(CLKPS0)) // F_CPU / 128
+#define SUSPEND_TIMER0_CLOCK_SELECT     _BV(CS01)                                 // F_CPU / 128 / 8 gives the same time base as F_CPU / 1024
+#define KEEP_ALIVE_WAIT_LOOPS           ((uint16_t) (F_CPU / (1000.0f * 8.0f / 1.2f)))    // 1.2 ms with the full clock, see busIsActive()
+#define SUSPEND_WAIT_LOOPS              ((uint16_t) (F_CPU / (128 * 1000.0f * 8.0f / WAIT_LOOP_MS))) // the whole wait with the suspend clock
+#endif
+
 // sLoopCommand used to trigger functions to run in the main loop
 enum {
     cmd_local_nop = 0,
@@ -117,18 +223,267 @@ enum {
     cmd_erase_application = 2,
     cmd_write_data = 3,
     cmd_exit = 4,
+    cmd_get_status = 5, // only with ENABLE_INTERLEAVED_ERASE, returns 1 byte: the number of pages still to erase
+    cmd_get_diagnostics = 6, // only with ENABLE_DIAGNOSTICS, returns the 10 bytes of usbDiagnostics
+    cmd_get_trace = 7, // only with ENABLE_TRACE, returns the ODTRACE_SIZE bytes of odTraceBuffer
+    cmd_get_bootloader_hash = 8, // only with ENABLE_BOOTLOADER_HASH, returns the BOOTLOADER_HASH_LENGTH bytes of bootloaderHash
+    cmd_self_update = 9, // only with ENABLE_SELF_UPDATE, wValue and wIndex are the low and high word of the CRC-32 of the staged bootloader
     cmd_write_page = 64  // internal commands start at 64
 };
 register uint8_t sLoopCommand asm("r3");  // bind sLoopCommand to r3
 
+#if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
+#define ERASE_UNIT_SIZE (SPM_PAGESIZE * 4) // these devices erase 4 pages at once
+#else
+#define ERASE_UNIT_SIZE SPM_PAGESIZE
+#endif
+
+#if defined(ENABLE_INTERLEAVED_ERASE)
+static uint8_t sErasePagesRemaining; // number of erase units below the bootloader which are not yet erased, reported by cmd_get_status
+#endif
+
+#if defined(ENABLE_DIAGNOSTICS)
+/*
+ * Counters of the USB events since the start of the bootloader, returned by cmd_get_diagnostics.
+ * The first 3 counters are incremented by the assembler part of the driver at the offsets USB_DIAG_* of usbdrv.h.
+ * All counters wrap around.
+ */
+struct {
+    uint8_t naks;           // NAK handshakes sent, because the last request was not yet processed
+    uint8_t overflows;      // packets longer than the receive buffer
+    uint8_t ignoredPackets; // packets for other addresses and handshakes of the host
+    uint8_t resets;         // host resets
+    uint8_t calibrations;   // runs of calibrateOscillatorASM()
+    uint8_t osccal;         // current OSCCAL value, set on request
+    uint16_t setups;        // SETUP packets processed
+    uint16_t collisions;    // packets missed, because the main loop was busy, see "Usbpoll() collided with data packet"
+} usbDiagnostics;
+#define DIAGNOSTICS_COUNT(aCounter) usbDiagnostics.aCounter++
+#else
+#define DIAGNOSTICS_COUNT(aCounter)
+#endif
+
+#if defined(ENABLE_SERIAL_NUMBER)
+/*
+ * String descriptor of the serial number, read by the host with GET_DESCRIPTOR for string 3.
+ * It is built from the bytes 0x0E to 0x17 of the signature row, which hold lot number, wafer number and
+ * position on the wafer. They are only documented for newer parts like the ATmega328PB, but are programmed
+ * into the older ATtinies and ATmegas too. Each byte gives 2 hexadecimal digits.
+ * The descriptor is written bytewise, so it has the USB byte order also in the native build with 32 bit int.
+ */
+#define SERIAL_NUMBER_SIGNATURE_START   0x0E
+int usbDescriptorStringSerialNumber[(2 + 2 * SERIAL_NUMBER_LENGTH + sizeof(int) - 1) / sizeof(int)];
+
+static void initSerialNumber(void) {
+    uint8_t *tDescriptor = (uint8_t *) usbDescriptorStringSerialNumber;
+    *tDescriptor++ = 2 + 2 * SERIAL_NUMBER_LENGTH;
+    *tDescriptor++ = USBDESCR_STRING;
+    for (uint8_t tAddress = SERIAL_NUMBER_SIGNATURE_START;
+            tAddress < SERIAL_NUMBER_SIGNATURE_START + SERIAL_NUMBER_LENGTH / 2; tAddress++) {
+        uint8_t tByte = boot_signature_byte_get(tAddress);
+        for (uint8_t i = 0; i < 2; i++) {
+            uint8_t tDigit = (i == 0 ? tByte >> 4 : tByte) & 0x0F;
+            *tDescriptor++ = tDigit + (tDigit < 10 ? '0' : 'A' - 10);
+            *tDescriptor++ = 0; // UTF-16LE
+        }
+    }
+}
+#endif
+
+#if defined(ENABLE_BOOTLOADER_HASH) || defined(ENABLE_SELF_UPDATE)
+/*
+ * CRC-32 (as used by zlib) of aLength bytes of the flash starting at aAddress.
+ * The bitwise computation takes around 100 cycles per byte, i.e. 10 ms for the 1.6 kByte of the ATtiny85 bootloader.
+ */
+static uint32_t computeFlashCrc(uint16_t aAddress, uint16_t aLength) {
+    uint32_t tCrc = 0xFFFFFFFF;
+    do {
+        tCrc ^= pgm_read_byte(aAddress++);
+        for (uint8_t i = 0; i < 8; i++) {
+            tCrc = (tCrc & 1) ? (tCrc >> 1) ^ 0xEDB88320 : tCrc >> 1;
+        }
+    } while (--aLength);
+    return ~tCrc;
+}
+#endif
+
+#if defined(ENABLE_BOOTLOADER_HASH)
+/*
+ * Reply of cmd_get_bootloader_hash. A host tool compares it with the bootloader of an upgrade, to skip the upgrade
+ * if the device already runs this build. All values are little endian.
+ * It is computed once at startup before the USB connect, since the bootloader does not change while it runs.
+ */
+#  if !defined(CONFIGURATION_ID)
+#define CONFIGURATION_ID        0 // set by the Makefile to the POSIX cksum of the configuration name
+#  endif
+#  if !defined(BOOTLOADER_END)
+/*
+ * Only the linked bootloader is hashed. The flash behind it may still hold the tail of a longer bootloader,
+ * since upgrade.hex writes only the pages of the new one.
+ */
+extern const uint8_t __data_load_end[]; // end of .text and the load image of .data, from the avr-libc linker script
+#define BOOTLOADER_END          ((uint16_t) __data_load_end)
+#  endif
+#define BOOTLOADER_HASH_LENGTH  10 // without the padding of the host compiler for the native build
+struct {
+    uint32_t crc;               // CRC-32 (as used by zlib) of the flash from BOOTLOADER_ADDRESS to BOOTLOADER_END
+    uint32_t configurationId;   // CONFIGURATION_ID
+    uint16_t length;            // number of bytes covered by the CRC
+} bootloaderHash;
+
+static void initBootloaderHash(void) {
+    uint16_t tLength = BOOTLOADER_END - BOOTLOADER_ADDRESS;
+    bootloaderHash.crc = computeFlashCrc(BOOTLOADER_ADDRESS, tLength);
+    bootloaderHash.configurationId = CONFIGURATION_ID;
+    bootloaderHash.length = tLength;
+}
+#endif
+
+#if defined(ENABLE_SELF_UPDATE)
+/*
+ * cmd_self_update replaces this bootloader by a new one, which the host has uploaded with the normal erase
+ * and page writes to the application area at SELF_UPDATE_STAGING_ADDRESS. Page 0 keeps the reset vector to us.
+ * The AVR can not execute code from RAM, so the copy is done by selfUpdateCopy() in the first erase unit
+ * of the bootloader, see crt1.S. This unit is not copied and must be identical in the new bootloader,
+ * which also rejects a bootloader for another device or BOOTLOADER_ADDRESS.
+ * The staging area must end before the last page of the application, which holds the postscript.
+ * The constants must match crt1.S.
+ */
+#define SELF_UPDATE_STAGING_ADDRESS SPM_PAGESIZE
+#define SELF_UPDATE_FIXED_SIZE      ERASE_UNIT_SIZE
+#define SELF_UPDATE_LENGTH          (FLASHEND + 1 - BOOTLOADER_ADDRESS)
+#  if SELF_UPDATE_STAGING_ADDRESS + SELF_UPDATE_LENGTH > BOOTLOADER_ADDRESS - SPM_PAGESIZE
+#error "ENABLE_SELF_UPDATE: the application area is too small to stage a copy of the bootloader"
+#  endif
+static uint32_t sSelfUpdateCrc; // CRC-32 of the staged bootloader, sent by the host with cmd_self_update
+void selfUpdateCopy(void) __attribute__((__noreturn__));
+
+/*
+ * Returns only if the staged bootloader is rejected, then the host sees that we do not disconnect.
+ * Otherwise we disconnect and the new bootloader connects again, without an application.
+ * A power failure during the copy bricks the device, as with upgrade.hex.
+ */
+static void selfUpdate(void) {
+#  if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+    boot_rww_enable(); // the staging area was just written
+#  endif
+    if (computeFlashCrc(SELF_UPDATE_STAGING_ADDRESS, SELF_UPDATE_LENGTH) != sSelfUpdateCrc) {
+        return;
+    }
+    for (uint16_t i = 0; i < SELF_UPDATE_FIXED_SIZE; i++) {
+        if (pgm_read_byte(SELF_UPDATE_STAGING_ADDRESS + i) != pgm_read_byte(BOOTLOADER_ADDRESS + i)) {
+            return;
+        }
+    }
+    usbDeviceDisconnect(); // Disable pullup resistor by pull down D-, the host sees us leave during the copy
+    selfUpdateCopy();
+}
+#endif
+
+/*
+ * Prefixes of the DBG1() trace points. With ENABLE_TRACE they are recorded with a time stamp, see usbdrv/oddebug.h.
+ * The start of an erase or write is recorded after waitForFrameStart(), directly before the CPU halt.
+ */
+#define TRACE_ERASE_START       0x01 // without ENABLE_INTERLEAVED_ERASE for the whole erase, with it for every page
+#define TRACE_ERASE_END         0x02
+#define TRACE_WRITE_START       0x03
+#define TRACE_WRITE_END         0x04
+#define TRACE_COLLISION         0x05 // resynchronization after the main loop missed a packet
+#define TRACE_RESET             0x06
+#define TRACE_STANDARD_SETUP    0x20 // + bRequest, SETUP packet of a standard request is processed
+#define TRACE_VENDOR_SETUP      0x30 // + bRequest, SETUP packet of a vendor or class request is processed
+
 /* ------------------------------------------------------------------------ */
 static inline void eraseApplication(void);
+#if defined(ENABLE_INTERLEAVED_ERASE)
+static void eraseNextPage(void);
+#endif
 static void writeFlashPage(void);
 static void writeWordToPageBuffer(uint16_t data);
 static uint8_t usbFunctionSetup(uint8_t data[8]);
 static inline void leaveBootloader(void);
 void blinkLED(uint8_t aBlinkCount);
+#if defined(ENABLE_FRAME_ALIGNED_SPM)
+static void waitForFrameStart(void);
+#else
+#define waitForFrameStart()
+#endif
+#if defined(ENABLE_LOW_POWER_IDLE) || defined(ENABLE_USB_SUSPEND)
+static void setSystemClock(uint8_t aClockDivisionBits, uint8_t aTimer0ClockSelect);
+#endif
+#if defined(ENABLE_USB_SUSPEND)
+static uint8_t busIsActive(uint16_t aTimeoutCounter);
+#endif
+
+#if defined(ENABLE_FRAME_ALIGNED_SPM)
+/*
+ * The CPU is halted for around 4.5 ms by each page erase or page write and every packet sent to us in this time is lost.
+ * The host starts a frame with a keep-alive (low speed EOP = SE0 for 1.33 us) every millisecond.
+ * Starting the SPM operation directly after a keep-alive makes the halt end at a known position in the frame,
+ * 0.5 ms before the keep-alive of frame (request frame + 1 + MICRONUCLEUS_WRITE_SLEEP). A host tool, which sees
+ * the feature flag, can send its next request in this frame and no packet is lost or cut into by the halt.
+ * The loop takes 7 cycles, so we sample SE0 at least twice at 12 MHz.
+ * Gives up after around 1.2 ms, i.e. if the host is suspended or no host is connected.
+ */
+static void waitForFrameStart(void) {
+    uint16_t tTimeoutCounter = (uint16_t) (F_CPU / (1000.0f * 7.0f / 1.2f));
+    // wait for SE0
+    while ((USBIN & USBMASK) != 0) {
+        if (--tTimeoutCounter == 0) {
+            return;
+        }
+    }
+    // wait for end of SE0
+    while ((USBIN & USBMASK) == 0) {
+        if (--tTimeoutCounter == 0) {
+            return;
+        }
+    }
+}
+#endif
+
+#if defined(ENABLE_USB_SUSPEND)
+/*
+ * A host sends a keep-alive (low speed EOP = SE0 for 1.33 us) every millisecond to an enabled low speed port
+ * and stops it to suspend the bus. Sampling for it in the wait loop for USB would lengthen the loop which has to catch
+ * the sync pattern of a packet, so we look for it only once per idle 5 ms period, like waitForFrameStart() does.
+ * Returns at the first sample which is not J, i.e. a keep-alive, the sync pattern of a packet, a resume (K) or a reset,
+ * so the wait loop for USB is entered again within the sync pattern. Returns 0 if the bus stayed J for aTimeoutCounter loops.
+ * The loop takes 8 cycles, so we sample SE0 at least twice at 12 MHz.
+ */
+static uint8_t busIsActive(uint16_t aTimeoutCounter) {
+    while ((USBIN & USBMASK) == _BV(USB_CFG_DMINUS_BIT)) { // J (idle)
+        if (--aTimeoutCounter == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
 
+#if defined(ENABLE_INTERLEAVED_ERASE)
+/*
+ * Only start erasing here. The main loop calls eraseNextPage() each time the bus was idle for a short time,
+ * so we can answer cmd_get_status between the page erases.
+ * Pages are erased in reverse order, see below.
+ */
+static inline void eraseApplication(void) {
+    sErasePagesRemaining = BOOTLOADER_ADDRESS / ERASE_UNIT_SIZE;
+    // Reset address to ensure the reset vector is written first.
+    currentAddress.w = 0;
+}
+
+static void eraseNextPage(void) {
+    sErasePagesRemaining--;
+    waitForFrameStart();
+    DBG1(TRACE_ERASE_START, 0, 0);
+    boot_page_erase(sErasePagesRemaining * ERASE_UNIT_SIZE);
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+    boot_spm_busy_wait();
+#endif
+    DBG1(TRACE_ERASE_END, 0, 0);
+}
+#else
 /*
  * erase all pages until bootloader, in reverse order (so our vectors stay in place for as long as possible)
  * to minimise the chance of leaving the device in a state where the bootloader wont run, if there's power failure
@@ -137,12 +492,14 @@ void blinkLED(uint8_t aBlinkCount);
 static inline void eraseApplication(void) {
     uint16_t ptr = BOOTLOADER_ADDRESS; // from Makefile.inc
 
+    DBG1(TRACE_ERASE_START, 0, 0);
     while (ptr) {
 #if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
     ptr -= SPM_PAGESIZE * 4;
 #else
         ptr -= SPM_PAGESIZE;
 #endif
+        waitForFrameStart();
         boot_page_erase(ptr);
         /*
          * Compiles to:
@@ -158,22 +515,28 @@ static inline void eraseApplication(void) {
     // the ATmegaATmega328p/168p/88p don't halt the CPU when writing to RWW flash, so we need to wait here
     boot_spm_busy_wait();
 #endif
+        odTraceTime(); // the whole erase takes longer than one wrap around of Timer0
     }
+    DBG1(TRACE_ERASE_END, 0, 0);
 
     // Reset address to ensure the reset vector is written first.
     currentAddress.w = 0;
 }
+#endif
 
 /*
  * Simply write currently stored page in to already erased flash memory
  */
 static inline void writeFlashPage(void) {
     if (currentAddress.w - 2 < BOOTLOADER_ADDRESS) {
+        waitForFrameStart();
+        DBG1(TRACE_WRITE_START, 0, 0);
         boot_page_write(currentAddress.w - 2);   // will halt CPU, no waiting required
 #if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
     // the ATmega328p/168p/88p don't halt the CPU when writing to RWW flash
     boot_spm_busy_wait();
 #endif
+        DBG1(TRACE_WRITE_END, 0, 0);
     }
 }
 
@@ -235,10 +598,42 @@ static void writeWordToPageBuffer(uint16_t data) {
 static uint8_t usbFunctionSetup(uint8_t data[8]) {
     usbRequest_t *rq = (void *) data;
 
-    idlePolls.b[1] = 0; // reset high byte of idle counter when we get usb class or vendor requests to start a new timeout
+    resetIdlePolls(); // reset idle counter when we get usb class or vendor requests to start a new timeout
     if (rq->bRequest == cmd_device_info) { // get device info
         usbMsgPtr = (usbMsgPtr_t) configurationReply;
         return sizeof(configurationReply);
+#if defined(ENABLE_INTERLEAVED_ERASE)
+    } else if (rq->bRequest == cmd_get_status) {
+        usbMsgPtr = (usbMsgPtr_t) &sErasePagesRemaining;
+        usbMsgFlags = USB_FLG_MSGPTR_IS_RAM;
+        return 1;
+#endif
+#if defined(ENABLE_DIAGNOSTICS)
+    } else if (rq->bRequest == cmd_get_diagnostics) {
+        usbDiagnostics.osccal = OSCCAL;
+        usbMsgPtr = (usbMsgPtr_t) &usbDiagnostics;
+        usbMsgFlags = USB_FLG_MSGPTR_IS_RAM;
+        return sizeof(usbDiagnostics);
+#endif
+#if defined(ENABLE_TRACE)
+    } else if (rq->bRequest == cmd_get_trace) {
+        odTraceTime(); // the host needs the current time stamp to relate the entries to its own time
+        odTraceHold = 1; // until the next SETUP, so the entries do not change while they are sent
+        usbMsgPtr = (usbMsgPtr_t) &odTraceBuffer;
+        usbMsgFlags = USB_FLG_MSGPTR_IS_RAM;
+        return ODTRACE_SIZE;
+#endif
+#if defined(ENABLE_BOOTLOADER_HASH)
+    } else if (rq->bRequest == cmd_get_bootloader_hash) {
+        usbMsgPtr = (usbMsgPtr_t) &bootloaderHash;
+        usbMsgFlags = USB_FLG_MSGPTR_IS_RAM;
+        return BOOTLOADER_HASH_LENGTH;
+#endif
+#if defined(ENABLE_SELF_UPDATE)
+    } else if (rq->bRequest == cmd_self_update) {
+        sSelfUpdateCrc = ((uint32_t) rq->wIndex.word << 16) | rq->wValue.word;
+        sLoopCommand = cmd_self_update;
+#endif
     } else if (rq->bRequest == cmd_transfer_page) {
         // Set page address. Address zero always has to be written first to ensure reset vector patching.
         // Mask to page boundary to prevent vulnerability to partial page write "attacks"
@@ -292,6 +687,26 @@ static void inactivateWatchdog(void) {
 #endif
 }
 
+#if defined(ENABLE_LOW_POWER_IDLE) || defined(ENABLE_USB_SUSPEND)
+/*
+ * The sleep modes can not be used, since they require a wake up interrupt, but we run with interrupts disabled
+ * and the interrupt vectors belong to the user program.
+ * Instead we divide the system clock, which reduces the supply current of the CPU accordingly,
+ * and keep the Timer0 time base by reducing its prescaler.
+ * ENABLE_LOW_POWER_IDLE uses F_CPU / 16 until the first host reset, since a host never sends a packet to a device before resetting it.
+ * ENABLE_USB_SUSPEND uses F_CPU / 128 while the bus is suspended.
+ */
+static void setSystemClock(uint8_t aClockDivisionBits, uint8_t aTimer0ClockSelect) {
+#ifdef CCP
+    CCP = 0xD8; // New ATtinies841/441 use a different unlock sequence
+#else
+    CLKPR = _BV(CLKPCE); // Unlock the clock prescaler register for 4 cycles
+#endif
+    CLKPR = aClockDivisionBits;
+    TIMER0_CLOCK_SELECT_REGISTER = aTimer0ClockSelect;
+}
+#endif
+
 /*
  * USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect
  * Initialize interrupt settings after reconnect but let the global interrupt be disabled
@@ -357,6 +772,13 @@ int main(void) {
 
         inactivateWatchdog(); // Sets at least watchdog timeout to 2 seconds.
 
+#if defined(ENABLE_SERIAL_NUMBER)
+        initSerialNumber(); // before the host can read it, we have no startup code which initializes the data section
+#endif
+#if defined(ENABLE_BOOTLOADER_HASH)
+        initBootloaderHash();
+#endif
+
         reconnectAndInitUSB(); // USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect, and enable USB interrupts
 
         LED_INIT(); // Set LED pin to output, if LED exists
@@ -369,15 +791,53 @@ int main(void) {
         idlePolls.w = ((AUTO_EXIT_MS - FAST_EXIT_NO_USB_MS) / 5);
 #else
         // start with 0 to exit after AUTO_EXIT_MS milliseconds (6 seconds) of USB inactivity (not connected or Idle)
+#  if defined(ENABLE_TIMER0_TIMEBASE)
+        idlePolls.w = 0;
+#  else
         idlePolls.b[1] = 0; // only set register 7, register 6 is almost random (determined by the usage before)
+#  endif
 #endif
 
+#if defined(ENABLE_LOW_POWER_IDLE)
+        setSystemClock(LOW_POWER_CLOCK_DIVISION_BITS, LOW_POWER_TIMER0_CLOCK_SELECT); // No host has reset us yet, so wait with low clock
+#elif defined(ENABLE_TIMER0_TIMEBASE)
+        TIMER0_CLOCK_SELECT_REGISTER = TIMER0_CLOCK_SELECT_1024;
+#endif
+#if defined(ENABLE_TIMER0_TIMEBASE)
+        uint8_t tIdleTick = TCNT0; // Timer0 value at the end of the last 5 ms period
+#endif
+        odDebugInit(); // after the start of Timer0, which gives the time stamps of the trace
+
         sLoopCommand = cmd_local_nop; // initialize register 3
         currentAddress.w = 0;
+#if defined(ENABLE_INTERLEAVED_ERASE)
+        sErasePagesRemaining = 0;
+#endif
+#if defined(ENABLE_DIAGNOSTICS)
+        for (uint8_t i = 0; i < sizeof(usbDiagnostics); i++) {
+            ((uint8_t *) &usbDiagnostics)[i] = 0; // we have no startup code which clears the bss section
+        }
+#endif
+#if defined(ENABLE_DIAGNOSTICS) || defined(ENABLE_TRACE)
+        uint8_t tResetSeen = 0; // a reset is detected every 100 samples as long as it lasts, count and trace it only once
+#endif
 
-#if ((OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0)) && defined(START_WITHOUT_PULLUP) // Adds 14 bytes
+#if ((OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0) || defined(ENABLE_LOW_POWER_IDLE)) && defined(START_WITHOUT_PULLUP) // Adds 14 bytes
         uint8_t resetDetected = 0; // Flag to call calibrateOscillatorASM() or reset idlePolls directly after host reset ends.
 #endif
+#if defined(ENABLE_INTERLEAVED_ERASE) || defined(ENABLE_USB_SUSPEND)
+        uint8_t tUsbActive = 0; // Flag set if the last wait for USB was terminated by USB traffic
+#endif
+#if defined(ENABLE_USB_SUSPEND)
+        /*
+         * The detection is armed by the first host reset or packet, otherwise we would suspend before enumeration.
+         * After every idle 5 ms period, busIsActive() waits for the next keep-alive. If there is none for 1.2 ms,
+         * the bus is suspended. While suspended, busIsActive() replaces the wait loop for USB and waits for a resume (K) or reset.
+         * The first sample of it restores the full clock, before V-USB sees any packet.
+         * A CPU halted by SPM or a busy main loop can not be mistaken for a suspended bus, since we look only after an idle period.
+         */
+        uint8_t tBusState = 0; // 0 = no bus activity up to now, 1 = active, 2 = suspended
+#endif
 
         /*
          * 1. Wait for 5 ms or USB transmission (and detect reset)
@@ -388,8 +848,45 @@ int main(void) {
          * 6. Resynchronize USB
          */
         do {
-            // Adjust t5msTimeoutCounter for 5ms loop timeout. We have 15 clock cycles per loop.
-            uint16_t t5msTimeoutCounter = (uint16_t) (F_CPU / (1000.0f * 15.0f / 5.0f));
+            // Adjust t5msTimeoutCounter for 5ms loop timeout (4 ms with Timer0). We have 15 clock cycles per loop.
+            uint16_t t5msTimeoutCounter = (uint16_t) (F_CPU / (1000.0f * 15.0f / WAIT_LOOP_MS));
+#if defined(ENABLE_INTERLEAVED_ERASE)
+            if (sErasePagesRemaining) {
+                /*
+                 * Erase the next page if the bus was idle for 0.3 ms, or for 1.1 ms after USB traffic.
+                 * The latter gives the host one frame for the next packet of the current transfer.
+                 */
+                t5msTimeoutCounter = (uint16_t) (F_CPU / (1000.0f * 15.0f / 0.3f));
+                if (tUsbActive) {
+                    t5msTimeoutCounter = (uint16_t) (F_CPU / (1000.0f * 15.0f / 1.1f));
+                }
+            }
+#endif
+#if defined(ENABLE_LOW_POWER_IDLE) || defined(ENABLE_USB_SUSPEND)
+            t5msTimeoutCounter >>= CLKPR; // the CLKPS bits are the log2 of the clock division, which slows down the loop
+#endif
+#if defined(ENABLE_USB_SUSPEND)
+            // Only after an idle period, otherwise the host is active anyway. The interleaved erase keeps the host active too.
+            if (tBusState && !tUsbActive
+#  if defined(ENABLE_INTERLEAVED_ERASE)
+                    && !sErasePagesRemaining
+#  endif
+                    ) {
+                if (busIsActive(tBusState == 2 ? SUSPEND_WAIT_LOOPS : KEEP_ALIVE_WAIT_LOOPS)) {
+                    if (tBusState == 2) {
+                        setSystemClock(0, TIMER0_CLOCK_SELECT_1024); // resume or reset, V-USB needs the full clock for the next packet
+                        tBusState = 1;
+                    }
+                } else {
+                    if (tBusState == 1) {
+                        // No keep-alive for more than 5 ms + 1.2 ms (USB requires 3 ms) -> the host suspended the bus
+                        tBusState = 2;
+                        setSystemClock(SUSPEND_CLOCK_DIVISION_BITS, SUSPEND_TIMER0_CLOCK_SELECT);
+                    }
+                    t5msTimeoutCounter = 1; // busIsActive() replaces the wait loop for USB while suspended
+                }
+            }
+#endif
             uint8_t tResetDownCounter = 100; // start value to detecting reset timing
             /*
              * Now wait for 5 ms or USB transmission
@@ -405,18 +902,22 @@ int main(void) {
                     tResetDownCounter = 100;
 
 #if defined(START_WITHOUT_PULLUP)
-#  if (OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0)
+#  if (OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0) || defined(ENABLE_LOW_POWER_IDLE)
                     /*
                      * Call calibrateOscillatorASM() or reset idlePolls only if USB is attached and after a reset, otherwise just skip it and wait for timeout.
                      * If USB has no pullup at VCC but at USB 5 volt, we will end up here only if USB 5 volt is connected and after host reset has ended.
                      */
                     if (resetDetected) {
                         resetDetected = 0; // do it only once after reset
+#    if defined(ENABLE_LOW_POWER_IDLE)
+                        setSystemClock(0, TIMER0_CLOCK_SELECT_1024); // USB is attached, now we need the full clock
+#    endif
 #    if (OSCCAL_HAVE_XTAL == 0)
                         calibrateOscillatorASM();
+                        DIAGNOSTICS_COUNT(calibrations);
 #    endif
 #    if (FAST_EXIT_NO_USB_MS > 0)
-                    idlePolls.b[1] = 0; // Reset counter to have 6 seconds timeout since we detected USB connection by end of a reset condition
+                    resetIdlePolls(); // Reset counter to have 6 seconds timeout since we detected USB connection by end of a reset condition
 #    endif
                     }
 #  endif
@@ -431,12 +932,28 @@ int main(void) {
                     // init 2 V-USB variables as done before in reset handling of usbpoll()
                     usbNewDeviceAddr = 0;
                     usbDeviceAddr = 0;
+#if defined(ENABLE_USB_SUSPEND)
+                    if (tBusState == 2) {
+                        setSystemClock(0, TIMER0_CLOCK_SELECT_1024); // a reset which started within the last loop ends the suspend
+                    }
+                    tBusState = 1; // arm the suspend detection
+#endif
+#if defined(ENABLE_DIAGNOSTICS) || defined(ENABLE_TRACE)
+                    if (!tResetSeen) {
+                        tResetSeen = 1;
+                        DIAGNOSTICS_COUNT(resets);
+                        DBG1(TRACE_RESET, 0, 0);
+                    }
+#endif
 
 #if defined(START_WITHOUT_PULLUP) // if not connected to USB we have an endless USB reset condition, so do actions after end of reset
-#  if (OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0)
+#  if (OSCCAL_HAVE_XTAL == 0) || (FAST_EXIT_NO_USB_MS > 0) || defined(ENABLE_LOW_POWER_IDLE)
                     resetDetected = 1;  // Set flag to wait for reset to end before calling calibrateOscillatorASM() or reset idlePolls.
 #  endif  // OSCCAL_HAVE_XTAL
 #else
+#  if defined(ENABLE_LOW_POWER_IDLE)
+                    setSystemClock(0, TIMER0_CLOCK_SELECT_1024); // The host will talk to us, so we need the full clock
+#  endif
 #  if (OSCCAL_HAVE_XTAL == 0)
                     /*
                      * Called if we received an host reset. This waits for the D- line to toggle or at least.
@@ -444,9 +961,13 @@ int main(void) {
                      * In this case we recognize a (dummy) host reset but no toggling at D- will occur.
                      */
                     calibrateOscillatorASM();
+                    DIAGNOSTICS_COUNT(calibrations);
+#    if defined(ENABLE_TIMER0_TIMEBASE)
+                    t5msTimeoutCounter = 1; // end the wait, so the main loop counts the Timer0 periods spent in the calibration
+#    endif
 #  endif
 #if (FAST_EXIT_NO_USB_MS > 0)
-                    idlePolls.b[1] = 0; // Reset counter to have 6 seconds timeout since we detected USB connection by getting a reset
+                    resetIdlePolls(); // Reset counter to have 6 seconds timeout since we detected USB connection by getting a reset
 #endif
 #endif
                 }
@@ -460,13 +981,28 @@ int main(void) {
                      * but this leads to periodically reconnecting if no user program is existent. This behavior is like the one of the v1.06 bootloader.
                      */
                     // idlePolls.b[1] = 0; // reset idle polls when we see usb traffic
+#if defined(ENABLE_USB_SUSPEND)
+                    if (tBusState == 2) {
+                        // The K of a resume, which started within the last loop, raised the flag. It lasts 20 ms, so no packet was missed.
+                        setSystemClock(0, TIMER0_CLOCK_SELECT_1024);
+                    }
+                    tBusState = 1; // a packet is bus activity too
+#endif
                     break;
                 }
-
             } while (--t5msTimeoutCounter); // after 5 ms fastctr is 0.
+#if defined(ENABLE_DIAGNOSTICS) || defined(ENABLE_TRACE)
+            if ((USBIN & USBMASK) != 0) {
+                tResetSeen = 0; // checked only every 5 ms to keep the wait loop short, a reset lasts at least 10 ms
+            }
+#endif
+#if defined(ENABLE_INTERLEAVED_ERASE) || defined(ENABLE_USB_SUSPEND)
+            tUsbActive = (t5msTimeoutCounter != 0);
+#endif
 
             asm volatile("wdr");
             // perform cyclically watchdog reset, for the case it is fused on and we can not disable it.
+            odTraceTime(); // count the wrap arounds of Timer0 for the trace time stamps
 
 #if OSCCAL_SLOW_PROGRAMMING // reduce clock to enable save flash programming timing
             uint8_t osccal_tmp  = OSCCAL;
@@ -478,13 +1014,32 @@ int main(void) {
             if (sLoopCommand == cmd_erase_application) {
                 eraseApplication();
             }
+#if defined(ENABLE_INTERLEAVED_ERASE)
+            else if (sErasePagesRemaining && !t5msTimeoutCounter) {
+                eraseNextPage(); // only if the bus was idle, otherwise we would miss the rest of the current transfer
+            }
+#endif
             if (sLoopCommand == cmd_write_page) {
+#if defined(ENABLE_INTERLEAVED_ERASE)
+                // A host which does not poll cmd_get_status only waits the erase time and may write before we are done
+                while (sErasePagesRemaining) {
+                    eraseNextPage();
+                }
+#endif
                 writeFlashPage();
             }
 #if OSCCAL_SLOW_PROGRAMMING
             OSCCAL      = osccal_tmp;
 #endif
 
+#if defined(ENABLE_SELF_UPDATE)
+            if (sLoopCommand == cmd_self_update) {
+                if (!t5msTimeoutCounter) {
+                    selfUpdate(); // Only after 5 ms timeout like cmd_exit, so the host got the status of the request
+                    sLoopCommand = cmd_local_nop;
+                }
+            } else
+#endif
             if (sLoopCommand == cmd_exit) {
                 if (!t5msTimeoutCounter) {
                     break;  // Only exit after 5 ms timeout
@@ -500,6 +1055,14 @@ int main(void) {
                 len = usbRxLen - 3;
 
                 if (len >= 0) {
+                    if (usbRxToken == USBPID_SETUP) {
+#if defined(ENABLE_TRACE)
+                        odTraceHold = 0;
+#endif
+                        DIAGNOSTICS_COUNT(setups);
+                        DBG1(((usbRxBuf[1] & USBRQ_TYPE_MASK) == USBRQ_TYPE_STANDARD ? TRACE_STANDARD_SETUP : TRACE_VENDOR_SETUP)
+                                + (usbRxBuf[2] & 0x0f), 0, 0);
+                    }
                     usbProcessRx(usbRxBuf + 1, len); // only single buffer due to in-order processing
                     usbRxLen = 0; /* mark rx buffer as available */
                 }
@@ -511,12 +1074,20 @@ int main(void) {
                 }
             }
 
+#if defined(ENABLE_TIMER0_TIMEBASE)
+            // Increment idle counter for every 5 ms period which has elapsed since the last loop
+            while ((uint8_t) (TCNT0 - tIdleTick) >= IDLE_POLL_TICKS) {
+                tIdleTick += IDLE_POLL_TICKS;
+                idlePolls.w++;
+            }
+#else
             // Increment idle counter at least every 5 ms
             idlePolls.w++;
+#endif
 
 #if (AUTO_EXIT_MS > 0)
             // Try to execute program when bootloader times out
-            if (idlePolls.w == (AUTO_EXIT_MS / 5) && pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1) != 0xff) {
+            if (idlePolls.w >= (AUTO_EXIT_MS / 5) && pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1) != 0xff) {
                 break; // Only exit to user program, if program exists
             }
 #endif
@@ -532,6 +1103,8 @@ int main(void) {
             if (USB_INTR_PENDING & (1 << USB_INTR_PENDING_BIT)) {
                 // Usbpoll() collided with data packet
                 uint8_t ctr;
+                DIAGNOSTICS_COUNT(collisions);
+                DBG1(TRACE_COLLISION, 0, 0);
 
                 // loop takes 5 cycles
                 asm volatile(
@@ -576,6 +1149,15 @@ int main(void) {
          */
         USB_INTR_ENABLE = 0;
         USB_INTR_CFG = 0; /* also reset config bits */
+#if defined(ENABLE_LOW_POWER_IDLE) || defined(ENABLE_USB_SUSPEND)
+        setSystemClock(0, 0); // The user program expects the full clock, even if no host has reset us or the bus is suspended
+#endif
+#if defined(ENABLE_TIMER0_TIMEBASE)
+        // Restore the reset values of Timer0 for the application
+        TIMER0_CLOCK_SELECT_REGISTER = 0;
+        TCNT0 = 0;
+        TIMER0_FLAG_REGISTER = TIMER0_FLAGS; // Flags are cleared by writing a one, otherwise the application gets an interrupt at once
+#endif
 
     }
 
@@ -4,7 +4,9 @@
 //
 // Upgrade will firstly rewrite the interrupt vector table to disable the bootloader,
 // rewriting it to just run the upgrade app. Next it erases and writes each page of the
-// bootloader in sequence, erasing over any remaining pages leaving them set to 0xFFFF
+// bootloader in sequence, erasing over any remaining pages leaving them set to 0xFFFF.
+// Pages which already contain the new code are left untouched, and if no page differs at all,
+// the interrupt vector table is not even rewritten to run the upgrade app.
 // Finally upgrader erases it's interrupt table again and fills it with RJMPs to
 // bootloaderAddress, effectively bridging the interrupts in to the new bootloader's
 // interrupts table.
@@ -13,10 +15,26 @@
 // work with other bootloaders and other chips with flash self program but no hardware
 // bootloader protection, where the bootloader exists at the end of flash
 //
-// Be very careful to not power down the AVR while upgrader is running.
+// The embedded bootloader is checked against the POSIX cksum computed by the Makefile before
+// anything is erased, if cksum or mncompress was available for the build. If it is damaged, the old bootloader is kept and waits for a new upload.
+// Every rewritten erase unit is read back and written again if it differs, and the whole new
+// bootloader is compared again before the vector table jumps to it. If it still differs, upgrade
+// restarts and writes it again, but only REWRITE_ATTEMPTS times. The attempts are counted by clearing
+// one bit of a byte in the page of the bootloader's postscript for each, so the count survives the
+// reboot. Then the flash is probably worn out and upgrade stops with the LED blinking fast.
+//
+// If the power fails while the bootloader is rewritten, the erased first page lets the chip slide
+// through the erased flash into the upgrader again on the next power-up. It compares the bootloader's
+// section again and continues with the first erase unit which differs, so the flash content itself
+// is the progress record. Only a power failure while page 0 is erased or written remains fatal.
 // If you connect a piezo between pb0 and pb1 you'll hear a bleep when the update
 // is complete. You can also connect an LED with pb1 positive and pb0 or gnd negative and
-// it will blink
+// it will blink. Before the bleep, the LED blinks once for every rewritten page.
+//
+// With COMPRESSED_BOOTLOADER (make COMPRESS_UPGRADE=1), the bootloader array is compressed
+// by tools/compress/mncompress and expanded here one erase unit at a time. Matches reaching
+// back before the current erase unit are read from the bootloader's section, which already
+// contains the new code at that time.
 
 #include "./utils.h"
 #include <avr/io.h>
@@ -29,16 +47,44 @@
 #include "bootloader.h"
 
 void secure_interrupt_vector_table(void);
-void write_new_bootloader(void);
+boolean payload_intact(void);
+boolean bootloader_differs(void);
+uint8_t write_new_bootloader(void);
 void forward_interrupt_vector_table(void);
+void blink(uint8_t count);
+void blink_error(void);
 void beep(void);
 void reboot(void);
+void count_rewrite(void);
 
 void load_table(uint16_t address, uint16_t words[SPM_PAGESIZE / 2]);
 void erase_page(uint16_t address);
 void write_page(uint16_t address, uint16_t words[SPM_PAGESIZE / 2]);
+uint32_t cksum_byte(uint32_t crc, uint8_t value);
+void start_new_bootloader(void);
+uint8_t new_bootloader_byte(int offset, int unit_addr);
+void load_new_unit(int unit_addr);
+boolean erase_unit_differs(int unit_addr);
 
 #define TINYVECTOR_RESET_OFFSET     4 // the exact value does not matter since we erase the whole page
+#define WRITE_ATTEMPTS              3 // writes of an erase unit until it reads back correctly
+#define REWRITE_ATTEMPTS            3 // complete rewrites of the bootloader, each followed by a reboot, before upgrade gives up
+#define REWRITE_COUNTER_ADDRESS     (BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET - 4) // below the postscript, one bit per rewrite
+
+#if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
+#define ERASE_UNIT_SIZE (SPM_PAGESIZE * 4) // these devices erase 4 pages at once
+#else
+#define ERASE_UNIT_SIZE SPM_PAGESIZE
+#endif
+
+uint16_t new_unit[ ERASE_UNIT_SIZE / 2 ]; // new bootloader code of the erase unit currently processed
+
+#if defined(COMPRESSED_BOOTLOADER)
+#define NEAR_MIN_MATCH 3 // see tools/compress/mncompress.c for the format
+const uint8_t * compressed_next; // next byte of the compressed bootloader
+uint8_t run_length; // bytes left of the current literal run or match
+uint16_t match_distance; // 0 for a literal run
+#endif
 
 int main(void) {
   pinsOff(0xFF); // pull down all pins
@@ -48,10 +94,38 @@ int main(void) {
   delay(250);
   cli();
 
-  secure_interrupt_vector_table(); // reset our vector table to it's original state
-  write_new_bootloader();
+  if ( !payload_intact() ) {
+    // nothing is erased yet, let the old bootloader wait for a new upload instead of starting us again, see below
+    erase_page(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1);
+    blink_error();
+    reboot();
+  }
+
+  uint8_t changed_pages = 0;
+  if ( bootloader_differs() ) {
+    boolean first_run = ( pgm_read_word( 0 ) != 0xFFFF ); // the vector table is not secured yet
+    if ( !first_run && !( pgm_read_byte( REWRITE_COUNTER_ADDRESS ) & _BV( REWRITE_ATTEMPTS - 1 ) ) ) {
+      // the flash did not take the new bootloader several times, do not wear it out any further
+      while ( true ) {
+        blink_error();
+      }
+    }
+    secure_interrupt_vector_table(); // reset our vector table to it's original state
+    if ( first_run ) {
+      // start with a fresh rewrite counter, the page may still contain the old bootloader if it starts lower
+      erase_page( REWRITE_COUNTER_ADDRESS );
+    }
+    changed_pages = write_new_bootloader();
+    if ( bootloader_differs() ) {
+      // do not commit, restart through the erased vector table and try again
+      count_rewrite();
+      blink_error();
+      reboot();
+    }
+  }
   forward_interrupt_vector_table();
 
+  blink( changed_pages );
   beep();
 
   /*
@@ -87,28 +161,167 @@ void secure_interrupt_vector_table( void ) {
 }
 
 
+// clear the lowest bit of the rewrite counter which is still set
+// the page is not erased, programming can only clear bits, so all other bytes are written as 0xFF
+void count_rewrite( void ) {
+  uint16_t table[ SPM_PAGESIZE / 2 ];
+  int iter = 0;
+  while ( iter < SPM_PAGESIZE / 2 ) {
+    table[ iter ] = 0xFFFF;
+    iter++;
+  }
+
+  table[ ( REWRITE_COUNTER_ADDRESS % SPM_PAGESIZE ) / 2 ] = 0xFF00 | (uint8_t) ( pgm_read_byte( REWRITE_COUNTER_ADDRESS ) << 1 );
+  write_page( REWRITE_COUNTER_ADDRESS - ( REWRITE_COUNTER_ADDRESS % SPM_PAGESIZE ), table );
+}
+
+
+// add one byte to the CRC of the POSIX cksum command
+uint32_t cksum_byte( uint32_t crc, uint8_t value ) {
+  crc ^= (uint32_t) value << 24;
+  uint8_t bit = 0;
+  while ( bit < 8 ) {
+    crc = ( crc & 0x80000000 ) ? ( crc << 1 ) ^ 0x04C11DB7 : crc << 1;
+    bit++;
+  }
+  return crc;
+}
+
+
+// compare the POSIX cksum of the embedded bytes with the one computed by the Makefile
+// the length is appended to the data with as few bytes as needed, as cksum does
+boolean payload_intact( void ) {
+#if !defined(bootloader_cksum)
+  return true; // built without cksum, e.g. with the tools of windows_exe
+#else
+  uint32_t crc = 0;
+  int offset = 0;
+  while ( offset < bootloader_payload_size ) {
+    crc = cksum_byte( crc, pgm_read_byte( ( (int) bootloader ) + offset ) );
+    offset++;
+  }
+  uint16_t length = bootloader_payload_size;
+  while ( length > 0 ) {
+    crc = cksum_byte( crc, length & 0xFF );
+    length >>= 8;
+  }
+  return ~crc == bootloader_cksum;
+#endif
+}
+
+
+// rewind to the first byte of the new bootloader code
+void start_new_bootloader( void ) {
+#if defined(COMPRESSED_BOOTLOADER)
+  compressed_next = bootloader;
+  run_length = 0;
+#endif
+}
+
+
+// read the next byte of the new bootloader code, bytes must be read in ascending order
+uint8_t new_bootloader_byte( int offset, int unit_addr ) {
+#if defined(COMPRESSED_BOOTLOADER)
+  if ( run_length == 0 ) {
+    uint8_t token = pgm_read_byte( compressed_next++ );
+    if ( token < 0x80 ) { // literal run
+      run_length = token + 1;
+      match_distance = 0;
+    } else {
+      run_length = ( token & 0x3F ) + NEAR_MIN_MATCH;
+      match_distance = pgm_read_byte( compressed_next++ ) + 1;
+      if ( token >= 0xC0 ) { // far match
+        match_distance += pgm_read_byte( compressed_next++ ) << 8;
+        run_length++;
+      }
+    }
+  }
+  run_length--;
+  if ( match_distance == 0 ) {
+    return pgm_read_byte( compressed_next++ );
+  }
+  int source = offset - match_distance;
+  if ( source >= unit_addr ) {
+    return ( (uint8_t *) new_unit )[ source - unit_addr ];
+  }
+  return pgm_read_byte( bootloader_address + source ); // already written or identical
+#else
+  (void) unit_addr;
+  return pgm_read_byte( ( (int) bootloader ) + offset );
+#endif
+}
+
+
+// fill new_unit with the new bootloader code of one erase unit, bytes behind its end are 0xFF
+void load_new_unit( int unit_addr ) {
+  int offset = unit_addr;
+  while ( offset < unit_addr + ERASE_UNIT_SIZE ) {
+    uint8_t value = 0xFF; // fill last words of last page
+    if ( offset < bootloader_size ) { // valid boot code
+      value = new_bootloader_byte( offset, unit_addr );
+    }
+    ( (uint8_t *) new_unit )[ offset - unit_addr ] = value;
+    offset++;
+  }
+}
+
+
+// compare one erase unit of the bootloader's section with new_unit
+boolean erase_unit_differs( int unit_addr ) {
+  int offset = 0;
+  while ( offset < ERASE_UNIT_SIZE ) {
+    if ( pgm_read_word( bootloader_address + unit_addr + offset ) != new_unit[ offset / 2 ] ) {
+      return true;
+    }
+    offset += 2;
+  }
+  return false;
+}
+
+
+// check if any page of the bootloader's section must be rewritten
+// stops at the first difference, since the compressed code may refer back to the pages before
+boolean bootloader_differs( void ) {
+  start_new_bootloader();
+  int unit_addr = 0;
+  while ( unit_addr < bootloader_size ) {
+    load_new_unit( unit_addr );
+    if ( erase_unit_differs( unit_addr ) ) {
+      return true;
+    }
+    unit_addr += ERASE_UNIT_SIZE;
+  }
+  return false;
+}
+
+
 // erase bootloader's section and write over it with new bootloader code
-void write_new_bootloader( void ) {
-  uint16_t outgoing_page[ SPM_PAGESIZE / 2 ]; // 64 bytes = 32 words
-  int page_addr = 0;
-  while ( page_addr < bootloader_size ) {
-    // read in one page's worth of data from progmem
-    int word_addr = 0;
-    while ( word_addr < SPM_PAGESIZE ) {
-      int subaddress = ( (int) bootloader ) + page_addr + word_addr;
-      if ( subaddress < ( (int) bootloader_end ) ) { // valid boot code
-        outgoing_page[ word_addr / 2 ] = pgm_read_word( subaddress );
-      } else { // fill last words of last page
-        outgoing_page[ word_addr / 2 ] = 0xFFFF;
+// erase units which already contain the new code are skipped, returns the number of rewritten pages
+// a rewritten erase unit is read back and written again if it differs, at most WRITE_ATTEMPTS times
+uint8_t write_new_bootloader( void ) {
+  uint8_t changed_pages = 0;
+  start_new_bootloader();
+  int unit_addr = 0;
+  while ( unit_addr < bootloader_size ) {
+    load_new_unit( unit_addr );
+    uint8_t attempts = 0;
+    while ( attempts < WRITE_ATTEMPTS && erase_unit_differs( unit_addr ) ) {
+      // erase unit in destination
+      erase_page( bootloader_address + unit_addr );
+      int page_addr = 0;
+      while ( page_addr < ERASE_UNIT_SIZE ) {
+        // write updated page
+        write_page( bootloader_address + unit_addr + page_addr, &new_unit[ page_addr / 2 ] );
+        page_addr += SPM_PAGESIZE;
       }
-      word_addr += 2;
+      attempts++;
     }
-    // erase page in destination
-    erase_page( bootloader_address + page_addr );
-    // write updated page
-    write_page( bootloader_address + page_addr, outgoing_page );
-    page_addr += SPM_PAGESIZE;
+    if ( attempts > 0 ) {
+      changed_pages += ERASE_UNIT_SIZE / SPM_PAGESIZE;
+    }
+    unit_addr += ERASE_UNIT_SIZE;
   }
+  return changed_pages;
 }
 
 
@@ -189,6 +402,37 @@ void write_page( uint16_t address, uint16_t words[ SPM_PAGESIZE / 2 ] ) {
 }
 
 
+// blink the LED once for every rewritten page, a piezo clicks instead
+void blink( uint8_t count ) {
+  outputs( pin(0) | pin(1) );
+  pinOff( 1 );
+
+  while ( count > 0 ) {
+    pinOn( 1 );
+    delay( 150 );
+    pinOff( 1 );
+    delay( 150 );
+    count--;
+  }
+  delay( 500 ); // separate the blinks from the beep
+}
+
+
+// flash the LED fast for 2 seconds, the upgrade did not complete
+void blink_error( void ) {
+  outputs( pin(0) | pin(1) );
+
+  byte i = 0;
+  while ( i < 20 ) {
+    pinOn( 1 );
+    delay( 50 );
+    pinOff( 1 );
+    delay( 50 );
+    i++;
+  }
+}
+
+
 // beep for half a second
 void beep( void ) {
   outputs( pin(0) | pin(1) );
@@ -182,7 +182,13 @@
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
+#if defined(ENABLE_SERIAL_NUMBER)
+/* The serial number is built at startup in RAM from the signature row, see initSerialNumber() in main.c */
+#define SERIAL_NUMBER_LENGTH                        20
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_RAM | USB_PROP_LENGTH(2 + 2 * SERIAL_NUMBER_LENGTH))
+#else
 #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#endif
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 
 #endif /* __usbconfig_h_included__ */
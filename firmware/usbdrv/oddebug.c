@@ -46,4 +46,45 @@ void    odDebug(uchar prefix, uchar *data, uchar len)
     uartPutc('\n');
 }
 
+#elif defined(ENABLE_TRACE)
+
+odTraceBuffer_t odTraceBuffer;
+uchar           odTraceHold;
+static uchar    lastTick;
+
+void    odDebugInit(void)
+{
+uchar   *p = (uchar *)&odTraceBuffer;
+uchar   i;
+
+    for(i = 0; i < ODTRACE_SIZE; i++)   /* the bootloader has no startup code which clears the bss section */
+        p[i] = 0;
+    odTraceHold = 0;
+    lastTick = TCNT0;
+}
+
+void    odTraceTime(void)
+{
+uchar           tick = TCNT0;
+unsigned short  time = odTraceBuffer.time[0] | (odTraceBuffer.time[1] << 8);
+
+    time += (uchar)(tick - lastTick);
+    lastTick = tick;
+    odTraceBuffer.time[0] = time;
+    odTraceBuffer.time[1] = time >> 8;
+}
+
+void    odTrace(uchar prefix)
+{
+uchar   *entry;
+
+    odTraceTime();
+    if(odTraceHold)
+        return;
+    entry = odTraceBuffer.entries[odTraceBuffer.count++ & (ODTRACE_ENTRIES - 1)];
+    entry[0] = prefix;
+    entry[1] = odTraceBuffer.time[0];
+    entry[2] = odTraceBuffer.time[1];
+}
+
 #endif
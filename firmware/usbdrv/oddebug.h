@@ -47,6 +47,8 @@ the output and a memory block to dump in hex ('data' and 'len').
 
 #if DEBUG_LEVEL > 0
 #   define  DBG1(prefix, data, len) odDebug(prefix, data, len)
+#elif defined(ENABLE_TRACE)
+#   define  DBG1(prefix, data, len) odTrace(prefix)
 #else
 #   define  DBG1(prefix, data, len)
 #endif
@@ -113,10 +115,42 @@ static inline void  odDebugInit(void)
     ODDBG_UCR |= (1<<ODDBG_TXEN);
     ODDBG_UBRR = F_CPU / (19200 * 16L) - 1;
 }
+#elif defined(ENABLE_TRACE)
+/* Micronucleus: devices without UART can not print the logs. With
+ * ENABLE_TRACE, DBG1 records only its prefix together with a time stamp in a
+ * ring buffer in RAM, which the application can send to the host. DBG2 logs
+ * are too frequent for the small buffer and are still no-ops.
+ * The time stamp counts Timer0 ticks. Timer0 must run with F_CPU / 1024 (or
+ * an equivalent time base) and odTraceTime() must be called at least every
+ * 256 ticks to count the wrap arounds of TCNT0. odDebugInit() clears the
+ * buffer and starts the time stamps at 0.
+ * The buffer is sent directly from RAM in several packets. The application
+ * sets odTraceHold while it is sent, so the host gets a consistent copy.
+ */
+#ifndef ODTRACE_ENTRIES
+#   define  ODTRACE_ENTRIES 32  /* power of 2 up to 64, the buffer is sent in one control transfer */
+#endif
+#define ODTRACE_SIZE    (3 + 3 * ODTRACE_ENTRIES)
+
+typedef struct {
+    uchar   time[2];                        /* current time stamp, updated by odTraceTime(), low byte first */
+    uchar   count;                          /* entries recorded modulo 256, the next one goes to count % ODTRACE_ENTRIES */
+    uchar   entries[ODTRACE_ENTRIES][3];    /* prefix, time stamp low byte, time stamp high byte */
+} odTraceBuffer_t;                          /* unused entries have prefix 0 */
+
+extern odTraceBuffer_t odTraceBuffer;
+extern uchar odTraceHold;   /* odTrace() records nothing while it is nonzero */
+extern void odDebugInit(void);
+extern void odTrace(uchar prefix);
+extern void odTraceTime(void);
 #else
 #   define odDebugInit()
 #endif
 
+#if DEBUG_LEVEL > 0 || !defined(ENABLE_TRACE)
+#   define odTraceTime()
+#endif
+
 /* ------------------------------------------------------------------------- */
 
 #endif /* __oddebug_h_included__ */
@@ -24,6 +24,10 @@
  *        the data section.
  */
 #define MNHACK_NO_DATASECTION
+/*     c) Optional replies from SRAM, if MNHACK_RAM_MSGPTR is defined by main.c for features which report state.
+ *        usbFunctionSetup() must then set USB_FLG_MSGPTR_IS_RAM in usbMsgFlags for a reply from SRAM.
+ *        The flag is cleared for each SETUP, so all other replies are still read from flash.
+ */
 
 #include "usbdrv.h"
 #include "oddebug.h"
@@ -59,6 +63,9 @@ usbMsgPtr_t         usbMsgPtr;      /* data to transmit next -- ROM or RAM addre
 #else
   static usbMsgLen_t  usbMsgLen = USB_NO_MSG; /* remaining number of bytes */
 #endif
+#ifdef MNHACK_RAM_MSGPTR
+uchar       usbMsgFlags;    /* flag values see USB_FLG_* */
+#endif
 
 #define USB_FLG_USE_USER_RW     (1<<7)
 
@@ -213,12 +220,23 @@ static inline void  usbResetStall(void)
  * This may cause problems with undefined symbols if compiled without
  * optimizing!
  */
+#ifdef MNHACK_RAM_MSGPTR
+// only static descriptors, in flash or with USB_PROP_IS_RAM in RAM
+#define GET_DESCRIPTOR(cfgProp, staticName)         \
+    if(cfgProp){                                    \
+        if((cfgProp) & USB_PROP_IS_RAM)             \
+            usbMsgFlags = USB_FLG_MSGPTR_IS_RAM;    \
+        len = USB_PROP_LENGTH(cfgProp);             \
+        usbMsgPtr = (usbMsgPtr_t)(staticName);      \
+    }
+#else
 // no ram descriptor possible here
 #define GET_DESCRIPTOR(cfgProp, staticName)         \
     if(cfgProp){                                    \
         len = USB_PROP_LENGTH(cfgProp);             \
         usbMsgPtr = (usbMsgPtr_t)(staticName);      \
     }
+#endif
 
 /* usbDriverDescriptor() is similar to usbFunctionDescriptor(), but used
  * internally for all types of descriptors.
@@ -311,6 +329,9 @@ usbRequest_t    *rq = (void *)data;
         usbMsgLen_t replyLen;
         usbTxBuf[0] = USBPID_DATA0;         /* initialize data toggling */
         usbTxLen = USBPID_NAK;              /* abort pending transmit */
+#ifdef MNHACK_RAM_MSGPTR
+        usbMsgFlags = 0;
+#endif
         uchar type = rq->bmRequestType & USBRQ_TYPE_MASK;
         if(type != USBRQ_TYPE_STANDARD){    /* standard requests are handled by driver */
             replyLen = usbFunctionSetup(data); // for USBRQ_TYPE_CLASS or USBRQ_TYPE_VENDOR
@@ -340,7 +361,11 @@ static uchar usbDeviceRead(uchar *data, uchar len)
         uchar i = len;
         usbMsgPtr_t r = usbMsgPtr;
         do{
+#ifdef MNHACK_RAM_MSGPTR
+            uchar c = (usbMsgFlags & USB_FLG_MSGPTR_IS_RAM) ? *r : USB_READ_FLASH(r);
+#else
             uchar c = USB_READ_FLASH(r);    /* assign to char size variable to enforce byte ops */
+#endif
             *data++ = c;
             r++;
         }while(--i);
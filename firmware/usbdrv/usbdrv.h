@@ -187,6 +187,10 @@ extern uchar usbMsgFlags;    /* flag values see USB_FLG_* */
  */
 
 #define USB_FLG_MSGPTR_IS_ROM   (1<<6)
+#define USB_FLG_MSGPTR_IS_RAM   (1<<5)
+/* Micronucleus: replies are read from flash by default. With MNHACK_RAM_MSGPTR
+ * `usbFunctionSetup()` can set `USB_FLG_MSGPTR_IS_RAM` for a reply from SRAM.
+ */
 
 USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8]);
 /* This function is called when the driver receives a SETUP transaction from
@@ -287,6 +291,15 @@ extern uchar    usbConfiguration;
 
 #endif  /* __ASSEMBLER__ */
 
+/* Micronucleus: with ENABLE_DIAGNOSTICS the assembler part of the driver
+ * increments 8 bit counters in `usbDiagnostics`, which is defined in main.c.
+ * These are the byte offsets of the counters, the assembler does not know the
+ * layout of the C structure.
+ */
+#define USB_DIAG_NAKS       0   /* NAK handshakes sent */
+#define USB_DIAG_OVERFLOWS  1   /* packets longer than the receive buffer */
+#define USB_DIAG_IGNORED    2   /* packets for other addresses and handshakes */
+
 
 /* ------------------------------------------------------------------------- */
 /* ----------------- Definitions for Descriptor Properties ----------------- */
@@ -300,6 +313,10 @@ extern uchar    usbConfiguration;
 /* If a static external descriptor is used, this is the total length of the
  * descriptor in bytes.
  */
+#define USB_PROP_IS_RAM         (1 << 15)
+/* The static external descriptor is in RAM instead of flash, needs
+ * MNHACK_RAM_MSGPTR, see usbdrv.c.
+ */
 
 /* all descriptors which may have properties: */
 #ifndef USB_CFG_DESCR_PROPS_DEVICE
@@ -0,0 +1,595 @@
+/* Name: bootloader_native.c
+ * Project: Micronucleus native build
+ *
+ * Compiles the unmodified firmware/main.c (and with it usbdrv.c) for the host.
+ * The AVR specific parts are replaced as follows:
+ *   - The I/O registers are modeled by include/avr/io.h and the accessors below.
+ *   - boot_page_fill/erase/write() act on a flash image and account for the CPU halt time.
+ *   - USB_handler() (usbdrvasm*.inc) is replaced by a packet feeder, which hands over
+ *     the packets of the host side (mnnative.c) on transaction level.
+ *   - calibrateOscillatorASM() and usbCrc16Append() are replaced by simple C versions.
+ *   - Inline assembler statements are dropped, register variables become globals
+ *     and leaving the bootloader returns control to the host side.
+ *   - usbWord_t contains an unsigned int, which has 4 instead of 2 bytes on the host.
+ *     Therefore the packet feeder stores SETUP packets widened to the host layout of usbRequest_t.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/boot.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+
+#include "native_avr.h"
+
+uint8_t native_io[0x100];
+static uint8_t sFlash[FLASHEND + 1];
+static uint16_t sPageBuffer[SPM_PAGESIZE / 2];
+static uint16_t sWritesPerPage[(FLASHEND + 1) / SPM_PAGESIZE];
+static uint64_t sCycles;
+
+native_flash_stats_t NativeFlashStats;
+native_usb_stats_t NativeUsbStats;
+double NativeSpmHaltMicros = NATIVE_SPM_HALT_US_DEFAULT;
+
+static void native_leave_bootloader(void) __attribute__((__noreturn__));
+
+/*
+ * Only called for the replaced inline assembler statements. A raw "spm" is only used to clear the page buffer.
+ */
+static inline void NATIVE_ASM(int aUnused) {
+    (void) aUnused;
+    if (SPMCSR & _BV(SPMEN)) {
+        if (SPMCSR & _BV(CTPB)) {
+            memset(sPageBuffer, 0xFF, sizeof(sPageBuffer));
+        }
+        SPMCSR = 0;
+    }
+}
+
+/*
+ * Make the AVR specific constructs of main.c digestible for the host compiler:
+ *   asm volatile("...")              -> NATIVE_ASM (0);
+ *   register uint8_t x asm("r3");    -> uint8_t x ;
+ *   __builtin_unreachable()          -> native_leave_bootloader()
+ */
+#define NATIVE_ASM(...)
+#define asm NATIVE_ASM
+#define volatile(...) (0)
+#define register
+#define __builtin_unreachable() native_leave_bootloader()
+#define main micronucleus_main
+
+void USB_handler(void);
+
+// The linked bootloader ends a page before FLASHEND, the last page stands for the tail of an older and longer one
+#define BOOTLOADER_END  (FLASHEND + 1 - SPM_PAGESIZE)
+
+#pragma pack(push, 1)   // like -fpack-struct of the firmware Makefile
+#include "main.c"
+#pragma pack(pop)
+
+#undef NATIVE_ASM
+#undef asm
+#undef volatile
+#undef register
+#undef __builtin_unreachable
+#undef main
+
+#if defined(ENABLE_SELF_UPDATE)
+/*
+ * Replaces selfUpdateCopy() of crt1.S with the same sequence of erases, fills and writes.
+ * The start of the new bootloader is not modeled, the device just leaves.
+ */
+void selfUpdateCopy(void) {
+    for (uint32_t tAddress = BOOTLOADER_ADDRESS + SELF_UPDATE_FIXED_SIZE; tAddress <= FLASHEND; tAddress += SPM_PAGESIZE) {
+        if (tAddress % ERASE_UNIT_SIZE == 0) {
+            native_spm(__BOOT_PAGE_ERASE, tAddress, 0);
+        }
+        const uint8_t *tStaged = &sFlash[tAddress - BOOTLOADER_ADDRESS + SELF_UPDATE_STAGING_ADDRESS];
+        for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+            native_spm(__BOOT_PAGE_FILL, tAddress + i, tStaged[i] | (tStaged[i + 1] << 8));
+        }
+        native_spm(__BOOT_PAGE_WRITE, tAddress, 0);
+    }
+    native_leave_bootloader();
+}
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+// MCUSR value which fulfills bootLoaderStartCondition() of the configuration
+#if ENTRYMODE == ENTRY_POWER_ON
+#define NATIVE_ENTRY_MCUSR  _BV(PORF)
+#elif ENTRYMODE == ENTRY_WATCHDOG
+#define NATIVE_ENTRY_MCUSR  _BV(WDRF)
+#else
+#define NATIVE_ENTRY_MCUSR  _BV(EXTRF)
+#endif
+
+const native_target_t NativeTarget = {
+NATIVE_CONFIG_NAME, F_CPU, BOOTLOADER_ADDRESS, BOOTLOADER_END, FLASHEND + 1, SPM_PAGESIZE, NATIVE_ENTRY_MCUSR };
+
+#define PIN_CHANGE_FLAG_MARKER  0x01  // unused bit of GIFR, lets us detect write-one-to-clear accesses
+#define PACKET_CATCH_CYCLES     64    // V-USB must start sampling within the sync pattern of the packet
+#define LOW_SPEED_BIT_CYCLES    ((double) F_CPU / 1500000.0)
+#define NO_WAKE                 UINT64_MAX
+#define RESUME_SIGNALING_MS     20    // host drives K for at least 20 ms to resume a suspended bus
+
+typedef struct {
+    uint8_t active;
+    uint8_t done;
+    int8_t result;          // 1 handled, 0 NAK, -1 lost, -2 stall
+    uint8_t token;          // USBPID_SETUP or USBPID_IN
+    uint8_t data[8];
+    uint8_t replyLength;
+    uint8_t reply[8];
+    uint64_t sendCycle;
+} native_transaction_t;
+
+static native_transaction_t sTransaction;
+static uint8_t sPinChangeFlags;
+static uint64_t sResetStart, sResetEnd;
+static uint64_t sSuspendStart = NO_WAKE, sSuspendEnd = NO_WAKE; // sSuspendEnd is the end of the resume signaling
+static uint64_t sResumeStart = NO_WAKE; // the J to K edge of the resume signaling, NO_WAKE after it raised the pin change flag
+static uint64_t sHostCycle, sHostWake = NO_WAKE;
+static uint8_t sLeft;
+static uint64_t sLeftCycle;
+
+static ucontext_t sHostContext, sDeviceContext;
+static uint8_t sDeviceStack[256 * 1024];
+
+static uint8_t clockDivider(void) {
+    return 1 << (CLKPR & 0x0F);
+}
+
+static void native_yield_to_host(void) {
+    swapcontext(&sDeviceContext, &sHostContext);
+}
+
+static void native_yield_to_device(void) {
+    swapcontext(&sHostContext, &sDeviceContext);
+}
+
+/*
+ * Every polling access costs the cycles of the real wait loop and gives the host side a chance to run.
+ */
+static void native_poll(uint8_t aCycles) {
+    uint8_t tDivider = clockDivider();
+    sCycles += (uint64_t) aCycles * tDivider;
+    if (tDivider > 1) {
+        NativeUsbStats.lowClockCycles += (uint64_t) aCycles * tDivider;
+    }
+    if (sCycles >= sHostWake) {
+        sHostWake = NO_WAKE;
+        native_yield_to_host();
+    }
+}
+
+static void native_leave_bootloader(void) {
+    sLeft = 1;
+    sLeftCycle = sCycles;
+    for (;;) {
+        native_yield_to_host();
+    }
+}
+
+static void native_device_entry(void) {
+    micronucleus_main();
+    native_leave_bootloader();
+}
+
+/* ------------------------------------------------------------------------ */
+/* Register accessors                                                       */
+/* ------------------------------------------------------------------------ */
+
+uint8_t *native_pin_register(uint8_t aAddress) {
+    static uint8_t sPin;
+    (void) aAddress;
+    native_poll(8);
+    uint8_t tLines = _BV(USB_CFG_DMINUS_BIT); // J
+    if (sCycles >= sResetStart && sCycles < sResetEnd) {
+        tLines = 0; // SE0
+    } else if (sCycles >= sSuspendStart && sCycles < sSuspendEnd) {
+        if (sSuspendEnd - sCycles <= (uint64_t) RESUME_SIGNALING_MS * (F_CPU / 1000)) {
+            tLines = _BV(USB_CFG_DPLUS_BIT); // K
+        }
+    } else if (sResetEnd && sCycles >= sResetEnd
+            && (sCycles - sResetEnd) % (F_CPU / 1000) < (uint64_t) (2 * LOW_SPEED_BIT_CYCLES)) {
+        tLines = 0; // keep-alive at the start of each frame, after the port was enabled by the first reset
+    } else if (sTransaction.active && !sTransaction.done && sCycles >= sTransaction.sendCycle) {
+        tLines = _BV(USB_CFG_DPLUS_BIT); // the sync pattern of a packet starts with K
+    }
+    sPin = (PORTB & DDRB) | (tLines & ~DDRB);
+    return &sPin;
+}
+
+uint8_t *native_pin_change_flag_register(void) {
+    static uint8_t sRegister = PIN_CHANGE_FLAG_MARKER;
+    if (!(sRegister & PIN_CHANGE_FLAG_MARKER)) {
+        sPinChangeFlags &= ~sRegister; // was written by the firmware
+    }
+    native_poll(7);
+    if (sCycles >= sResumeStart) {
+        sResumeStart = NO_WAKE;
+        sPinChangeFlags |= _BV(USB_INTR_PENDING_BIT); // D+ goes high
+    }
+    native_transaction_t *t = &sTransaction;
+    if (t->active && !t->done && sCycles >= t->sendCycle) {
+        if (sCycles - t->sendCycle > PACKET_CATCH_CYCLES || clockDivider() > 1) {
+            // We were halted or busy while the packet passed by, or V-USB can not sample it with the divided clock
+            t->done = 1;
+            t->result = -1;
+            NativeUsbStats.packetsLost++;
+            sHostWake = 0;
+        } else {
+            sPinChangeFlags |= _BV(USB_INTR_PENDING_BIT);
+        }
+    }
+    sRegister = sPinChangeFlags | PIN_CHANGE_FLAG_MARKER;
+    return &sRegister;
+}
+
+uint8_t *native_timer0_counter(void) {
+    static const uint16_t sPrescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    static uint8_t sValue, sOffset;
+    static uint64_t sTicks;
+    if (sValue != (uint8_t) (sTicks + sOffset)) {
+        sOffset = sValue - (uint8_t) sTicks; // was written by the firmware
+    }
+    sCycles += clockDivider();
+    uint16_t tPrescaler = sPrescaler[TCCR0B & 0x07];
+    if (tPrescaler) {
+        sTicks = sCycles / ((uint64_t) tPrescaler * clockDivider());
+    }
+    sValue = (uint8_t) (sTicks + sOffset);
+    return &sValue;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Flash model                                                              */
+/* ------------------------------------------------------------------------ */
+
+uint8_t native_pgm_read_byte(uintptr_t aAddress) {
+    if (aAddress <= FLASHEND) {
+        return sFlash[aAddress];
+    }
+    return *(const uint8_t *) aAddress; // PROGMEM table of the host program
+}
+
+uint8_t native_signature_byte(uint8_t aAddress) {
+    // 0x0E to 0x17 are lot number, wafer number and position on the wafer of one chip
+    static const uint8_t sSignatureRow[] = { SIGNATURE_0, 0x9A, SIGNATURE_1, 0xFF, SIGNATURE_2, 0xFF, 0xFF, 0xFF, 0xFF,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x56, 0x37, 0x31, 0x33, 0x35, 0x39, 0x10, 0x0C, 0x13, 0x00 };
+    return aAddress < sizeof(sSignatureRow) ? sSignatureRow[aAddress] : 0xFF;
+}
+
+static void native_halt_for_spm(void) {
+    uint64_t tHalt = (uint64_t) (NativeSpmHaltMicros * (F_CPU / 1000000.0));
+    sCycles += tHalt;
+    NativeFlashStats.haltCycles += tHalt;
+}
+
+void native_spm(uint8_t aSpmcsr, uint16_t aAddress, uint16_t aData) {
+    uint16_t tPage = (aAddress % (FLASHEND + 1)) / SPM_PAGESIZE;
+    uint8_t *tPageStart = &sFlash[tPage * SPM_PAGESIZE];
+    if (aSpmcsr == __BOOT_PAGE_FILL) {
+        sPageBuffer[(aAddress % SPM_PAGESIZE) / 2] = aData;
+        NativeFlashStats.wordFills++;
+    } else if (aSpmcsr == __BOOT_PAGE_ERASE) {
+        memset(tPageStart, 0xFF, SPM_PAGESIZE);
+        NativeFlashStats.pageErases++;
+        native_halt_for_spm();
+    } else if (aSpmcsr == __BOOT_PAGE_WRITE) {
+        // Programming can only clear bits
+        for (uint16_t i = 0; i < SPM_PAGESIZE / 2; i++) {
+            tPageStart[2 * i] &= sPageBuffer[i] & 0xFF;
+            tPageStart[2 * i + 1] &= sPageBuffer[i] >> 8;
+        }
+        memset(sPageBuffer, 0xFF, sizeof(sPageBuffer));
+        NativeFlashStats.pageWrites++;
+        if (++sWritesPerPage[tPage] > NativeFlashStats.maxWritesPerPage) {
+            NativeFlashStats.maxWritesPerPage = sWritesPerPage[tPage];
+        }
+        native_halt_for_spm();
+    }
+}
+
+void native_delay_us(double aMicroseconds) {
+    sCycles += (uint64_t) (aMicroseconds * (F_CPU / 1000000.0)) * clockDivider();
+}
+
+/* ------------------------------------------------------------------------ */
+/* Replacements for the assembler modules                                   */
+/* ------------------------------------------------------------------------ */
+
+/*
+ * The real routine measures about 11 frames of 1 ms. We assume a perfectly trimmed oscillator.
+ */
+void calibrateOscillatorASM(void) {
+    native_delay_us(11000);
+}
+
+unsigned (usbCrc16Append)(unsigned data, uchar len) {
+    uint8_t *tData = (uint8_t *) (uintptr_t) data;
+    uint16_t tCrc = 0xFFFF;
+    for (uint8_t i = 0; i < len; i++) {
+        tCrc ^= tData[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            tCrc = (tCrc & 1) ? (tCrc >> 1) ^ 0xA001 : tCrc >> 1;
+        }
+    }
+    tCrc = ~tCrc;
+    tData[len] = tCrc & 0xFF;
+    tData[len + 1] = tCrc >> 8;
+    return tCrc;
+}
+
+/*
+ * Packet feeder. Called by the main loop if the pin change flag was set for a pending host transaction.
+ * Does what the receiver and transmitter in usbdrvasm*.inc and asmcommon.inc do with it.
+ */
+void USB_handler(void) {
+    native_transaction_t *t = &sTransaction;
+    if (!t->active || t->done) {
+        return;
+    }
+    uint16_t tBusBits;
+    if (t->token == USBPID_SETUP) {
+        tBusBits = (4 + 12 + 2) * 8; // SETUP token, DATA0 with 8 bytes, ACK
+        if (usbRxLen != 0) {
+            t->result = 0; // asmcommon.inc: handleData -> sendNakAndReti
+        } else {
+            usbRxBuf[usbInputBufOffset] = USBPID_DATA0;
+            usbRequest_t *tRequest = (usbRequest_t *) &usbRxBuf[usbInputBufOffset + 1];
+            tRequest->bmRequestType = t->data[0];
+            tRequest->bRequest = t->data[1];
+            tRequest->wValue.word = t->data[2] | (t->data[3] << 8);
+            tRequest->wIndex.word = t->data[4] | (t->data[5] << 8);
+            tRequest->wLength.word = t->data[6] | (t->data[7] << 8);
+            usbCurrentTok = USBPID_SETUP;
+            usbRxToken = USBPID_SETUP;
+            usbRxLen = 11;
+            t->result = 1;
+        }
+    } else {
+        tBusBits = 4 * 8; // IN token
+        if (usbRxLen >= 1 || (usbTxLen & 0x10)) {
+            // unprocessed input or handshake token pending
+            t->result = (usbTxLen == USBPID_STALL) ? -2 : 0;
+            tBusBits += 2 * 8;
+            NativeUsbStats.naks++;
+        } else {
+            t->replyLength = usbTxLen - 4; // minus sync, PID and CRC
+            memcpy(t->reply, &usbTxBuf[1], t->replyLength);
+            tBusBits += usbTxLen * 8 + 2 * 8; // data packet and ACK
+            usbTxLen = USBPID_NAK;
+            usbDeviceAddr = usbNewDeviceAddr << 1;
+            t->result = 1;
+        }
+    }
+    // Bit stuffing and inter packet gaps are covered by 20% overhead
+    sCycles += (uint64_t) (tBusBits * 1.2 * LOW_SPEED_BIT_CYCLES);
+    t->done = 1;
+    sHostWake = 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Device side control                                                      */
+/* ------------------------------------------------------------------------ */
+
+void native_reset(uint8_t aMcusr) {
+    memset(native_io, 0, sizeof(native_io));
+    MCUSR = aMcusr;
+    OSCCAL = 0x80;
+    memset(sPageBuffer, 0xFF, sizeof(sPageBuffer));
+    memset(&sTransaction, 0, sizeof(sTransaction));
+    usbRxLen = 0;
+    usbTxLen = USBPID_NAK;
+    usbInputBufOffset = 0;
+    sPinChangeFlags = 0;
+    sResetStart = sResetEnd = 0;
+    sSuspendStart = sSuspendEnd = sResumeStart = NO_WAKE;
+    sCycles = 0;
+    sHostCycle = 0;
+    sHostWake = NO_WAKE;
+    sLeft = 0;
+    memset(&NativeUsbStats, 0, sizeof(NativeUsbStats));
+}
+
+uint8_t *native_flash(void) {
+    return sFlash;
+}
+
+uint64_t native_now(void) {
+    return sCycles;
+}
+
+uint8_t native_has_left_bootloader(void) {
+    return sLeft;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Host side                                                                */
+/* ------------------------------------------------------------------------ */
+
+#define HOST_HARDWARE_RETRIES   3       // the host controller gives up after 3 failed attempts
+#define HOST_NAK_TIMEOUT_MS     5000    // libusb default control transfer timeout of the micronucleus tool
+
+static double hostCyclesPerMicro(void) {
+    return F_CPU / 1000000.0;
+}
+
+/*
+ * Let the device run until the host side time is reached
+ */
+static void host_run_device(void) {
+    if (sLeft) {
+        return;
+    }
+    sHostWake = sHostCycle;
+    native_yield_to_device();
+    if (sCycles > sHostCycle) {
+        sHostCycle = sCycles;
+    }
+}
+
+/*
+ * Runs the bootloader until it polls the bus the first time, i.e. after it has connected.
+ */
+void host_start(void) {
+    getcontext(&sDeviceContext);
+    sDeviceContext.uc_stack.ss_sp = sDeviceStack;
+    sDeviceContext.uc_stack.ss_size = sizeof(sDeviceStack);
+    sDeviceContext.uc_link = &sHostContext;
+    makecontext(&sDeviceContext, native_device_entry, 0);
+    sHostCycle = 0;
+    host_run_device();
+}
+
+void host_wait_us(double aMicroseconds) {
+    sHostCycle += (uint64_t) (aMicroseconds * hostCyclesPerMicro());
+    host_run_device();
+}
+
+void host_suspend(double aMilliseconds) {
+    sSuspendStart = sHostCycle;
+    sSuspendEnd = sHostCycle + (uint64_t) ((aMilliseconds + RESUME_SIGNALING_MS) * 1000 * hostCyclesPerMicro());
+    sResumeStart = sSuspendEnd - (uint64_t) RESUME_SIGNALING_MS * (F_CPU / 1000);
+    sHostCycle = sSuspendEnd;
+    host_run_device();
+}
+
+void host_bus_reset(double aMilliseconds) {
+    sResetStart = sHostCycle;
+    sResetEnd = sHostCycle + (uint64_t) (aMilliseconds * 1000 * hostCyclesPerMicro());
+    sHostCycle = sResetEnd;
+    host_run_device();
+}
+
+/*
+ * One transaction including the hardware retries of the host controller.
+ * The packet is sent at the current host time, regardless of whether the device listens.
+ */
+static int host_transaction(uint8_t aToken, const uint8_t *aData, uint8_t *aReply) {
+    uint64_t tNakDeadline = sHostCycle + (uint64_t) (HOST_NAK_TIMEOUT_MS * 1000 * hostCyclesPerMicro());
+    uint8_t tErrors = 0;
+    while (!sLeft) {
+        memset(&sTransaction, 0, sizeof(sTransaction));
+        sTransaction.active = 1;
+        sTransaction.token = aToken;
+        if (aData) {
+            memcpy(sTransaction.data, aData, 8);
+        }
+        sTransaction.sendCycle = sHostCycle;
+        while (!sTransaction.done && !sLeft) {
+            sHostWake = NO_WAKE;
+            native_yield_to_device();
+        }
+        sTransaction.active = 0;
+        if (sCycles > sHostCycle) {
+            sHostCycle = sCycles;
+        }
+        if (sTransaction.result == 1) {
+            if (aReply) {
+                memcpy(aReply, sTransaction.reply, sTransaction.replyLength);
+            }
+            return sTransaction.replyLength;
+        }
+        if (sTransaction.result == -2) {
+            return -1;
+        }
+        if (sTransaction.result == 0) {
+            // NAK, retry in the next frame
+            if (sHostCycle > tNakDeadline) {
+                return -1;
+            }
+            host_wait_us(1000);
+        } else if (++tErrors >= HOST_HARDWARE_RETRIES) {
+            return -1;
+        } else {
+            // time out of 18 bit times, then retry
+            sHostCycle += (uint64_t) (18 * LOW_SPEED_BIT_CYCLES);
+        }
+    }
+    return -1;
+}
+
+static int host_control(uint8_t aRequestType, uint8_t aRequest, uint16_t aValue, uint16_t aIndex, uint8_t *aBuffer,
+        uint8_t aLength) {
+    uint8_t tSetup[8] = { aRequestType, aRequest, aValue & 0xFF, aValue >> 8, aIndex & 0xFF, aIndex >> 8, aLength, 0 };
+    NativeUsbStats.transfers++;
+    if ((aRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR && aRequest < NATIVE_REQUEST_COUNT) {
+        NativeUsbStats.requests[aRequest]++;
+    }
+    if (host_transaction(USBPID_SETUP, tSetup, NULL) < 0) {
+        return -1;
+    }
+    // Data stage for IN requests or status stage for requests without data
+    uint8_t tReceived = 0;
+    do {
+        uint8_t tPacket[8];
+        int tLength = host_transaction(USBPID_IN, NULL, tPacket);
+        if (tLength < 0) {
+            return -1;
+        }
+        if (tReceived + tLength > aLength) {
+            tLength = aLength - tReceived;
+        }
+        if (aBuffer && tLength > 0) {
+            memcpy(aBuffer + tReceived, tPacket, tLength);
+        }
+        tReceived += tLength;
+        if (tLength < 8) {
+            break;
+        }
+    } while (tReceived < aLength);
+    // The status stage of IN requests is a zero length OUT packet, which the device just acknowledges
+    if (aLength) {
+        sHostCycle += (uint64_t) ((4 + 4 + 2) * 8 * 1.2 * LOW_SPEED_BIT_CYCLES);
+    }
+    NativeUsbStats.cycles = sHostCycle;
+    return tReceived;
+}
+
+int host_control_in(uint8_t aRequest, uint16_t aValue, uint16_t aIndex, uint8_t *aBuffer, uint8_t aLength) {
+    return host_control(USBRQ_DIR_DEVICE_TO_HOST | USBRQ_TYPE_VENDOR | USBRQ_RCPT_DEVICE, aRequest, aValue, aIndex, aBuffer,
+            aLength);
+}
+
+int host_control_out(uint8_t aRequest, uint16_t aValue, uint16_t aIndex) {
+    return host_control(USBRQ_DIR_HOST_TO_DEVICE | USBRQ_TYPE_VENDOR | USBRQ_RCPT_DEVICE, aRequest, aValue, aIndex, NULL, 0);
+}
+
+int host_get_descriptor(uint8_t aType, uint8_t aIndex, uint8_t *aBuffer, uint8_t aLength) {
+    return host_control(USBRQ_DIR_DEVICE_TO_HOST | USBRQ_TYPE_STANDARD | USBRQ_RCPT_DEVICE, USBRQ_GET_DESCRIPTOR,
+            (aType << 8) | aIndex, 0, aBuffer, aLength);
+}
+
+/*
+ * Returns the time in microseconds from now until the bootloader jumped to the user program or -1 on timeout.
+ */
+int host_wait_for_exit(double aTimeoutMilliseconds) {
+    uint64_t tStart = sHostCycle;
+    uint64_t tEnd = tStart + (uint64_t) (aTimeoutMilliseconds * 1000 * hostCyclesPerMicro());
+    while (!sLeft && sHostCycle < tEnd) {
+        host_wait_us(1000);
+    }
+    if (!sLeft) {
+        return -1;
+    }
+    if (sLeftCycle < tStart) {
+        return 0; // has left before
+    }
+    sHostCycle = sLeftCycle;
+    return (int) ((sLeftCycle - tStart) / hostCyclesPerMicro());
+}
@@ -0,0 +1,31 @@
+/* Name: avr/boot.h
+ * Project: Micronucleus native build
+ *
+ * The SPM primitives are routed to the flash model of bootloader_native.c, which
+ * applies them to the flash image and accounts for the CPU halt time.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_avr_boot_h_included__
+#define __native_avr_boot_h_included__
+
+#include <stdint.h>
+#include <avr/io.h>
+
+void native_spm(uint8_t aSpmcsr, uint16_t aAddress, uint16_t aData);
+uint8_t native_signature_byte(uint8_t aAddress);
+
+#define __SPM_REG           SPMCSR
+#define __SPM_ENABLE        SPMEN
+#define __BOOT_PAGE_ERASE   (_BV(SPMEN) | _BV(PGERS))
+#define __BOOT_PAGE_WRITE   (_BV(SPMEN) | _BV(PGWRT))
+#define __BOOT_PAGE_FILL    _BV(SPMEN)
+
+#define boot_page_fill(address, data)   native_spm(__BOOT_PAGE_FILL, (uint16_t) (address), (uint16_t) (data))
+#define boot_page_erase(address)        native_spm(__BOOT_PAGE_ERASE, (uint16_t) (address), 0)
+#define boot_page_write(address)        native_spm(__BOOT_PAGE_WRITE, (uint16_t) (address), 0)
+#define boot_spm_busy()                 0
+#define boot_spm_busy_wait()            do {} while (boot_spm_busy())
+#define boot_signature_byte_get(address) native_signature_byte((uint8_t) (address))
+
+#endif /* __native_avr_boot_h_included__ */
@@ -0,0 +1,122 @@
+/* Name: avr/io.h
+ * Project: Micronucleus native build
+ *
+ * Minimal stand-in for the avr-libc register definitions of the ATtiny25/45/85,
+ * so that main.c and usbdrv.c can be compiled for the host.
+ * Plain registers are bytes in native_io[] at their data space address.
+ * Registers with side effects (pin input, pin change flag, timer) are routed
+ * through the accessor functions of bootloader_native.c.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_avr_io_h_included__
+#define __native_avr_io_h_included__
+
+#include <stdint.h>
+
+#if !(defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny25__))
+#error "The native build only models the ATtiny25/45/85 register set"
+#endif
+
+extern uint8_t native_io[0x100];
+uint8_t *native_pin_register(uint8_t aAddress);
+uint8_t *native_pin_change_flag_register(void);
+uint8_t *native_timer0_counter(void);
+
+#define _BV(bit)            (1 << (bit))
+#define _SFR_MEM8(address)  (native_io[(address)])
+#define _SFR_IO_ADDR(sfr)   0
+
+#define SREG    _SFR_MEM8(0x5F)
+#define GIMSK   _SFR_MEM8(0x5B)
+#define GIFR    (*native_pin_change_flag_register())
+#define TIMSK   _SFR_MEM8(0x59)
+#define TIFR    _SFR_MEM8(0x58)
+#define SPMCSR  _SFR_MEM8(0x57)
+#define MCUCR   _SFR_MEM8(0x55)
+#define MCUSR   _SFR_MEM8(0x54)
+#define TCCR0B  _SFR_MEM8(0x53)
+#define TCNT0   (*native_timer0_counter())
+#define OSCCAL  _SFR_MEM8(0x51)
+#define TCCR0A  _SFR_MEM8(0x4A)
+#define PLLCSR  _SFR_MEM8(0x47)
+#define CLKPR   _SFR_MEM8(0x46)
+#define WDTCR   _SFR_MEM8(0x41)
+#define PRR     _SFR_MEM8(0x40)
+#define PORTB   _SFR_MEM8(0x38)
+#define DDRB    _SFR_MEM8(0x37)
+#define PINB    (*native_pin_register(0x36))
+#define PCMSK   _SFR_MEM8(0x35)
+#define GPIOR0  _SFR_MEM8(0x31)
+
+/* GIMSK / GIFR */
+#define INT0    6
+#define PCIE    5
+#define INTF0   6
+#define PCIF    5
+/* MCUCR */
+#define SE      5
+#define SM1     4
+#define SM0     3
+/* MCUSR */
+#define WDRF    3
+#define BORF    2
+#define EXTRF   1
+#define PORF    0
+/* SPMCSR */
+#define RSIG    5
+#define CTPB    4
+#define RFLB    3
+#define PGWRT   2
+#define PGERS   1
+#define SPMEN   0
+/* TCCR0B, TIFR */
+#define CS02    2
+#define CS01    1
+#define CS00    0
+#define OCF0A   4
+#define OCF0B   3
+#define TOV0    1
+/* CLKPR */
+#define CLKPCE  7
+#define CLKPS3  3
+#define CLKPS2  2
+#define CLKPS1  1
+#define CLKPS0  0
+/* WDTCR */
+#define WDIF    7
+#define WDIE    6
+#define WDP3    5
+#define WDCE    4
+#define WDE     3
+#define WDP2    2
+#define WDP1    1
+#define WDP0    0
+/* PORTB / DDRB / PINB */
+#define PB5     5
+#define PB4     4
+#define PB3     3
+#define PB2     2
+#define PB1     1
+#define PB0     0
+
+#define RAMEND          0x25F
+#define SIGNATURE_0     0x1E
+#if defined(__AVR_ATtiny85__)
+#  define FLASHEND      0x1FFF
+#  define SPM_PAGESIZE  64
+#  define SIGNATURE_1   0x93
+#  define SIGNATURE_2   0x0B
+#elif defined(__AVR_ATtiny45__)
+#  define FLASHEND      0x0FFF
+#  define SPM_PAGESIZE  64
+#  define SIGNATURE_1   0x92
+#  define SIGNATURE_2   0x06
+#else
+#  define FLASHEND      0x07FF
+#  define SPM_PAGESIZE  32
+#  define SIGNATURE_1   0x91
+#  define SIGNATURE_2   0x08
+#endif
+
+#endif /* __native_avr_io_h_included__ */
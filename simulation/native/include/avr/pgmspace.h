@@ -0,0 +1,21 @@
+/* Name: avr/pgmspace.h
+ * Project: Micronucleus native build
+ *
+ * Flash reads go to the flash model for addresses inside the device flash
+ * and are plain memory reads for host pointers to PROGMEM tables.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_avr_pgmspace_h_included__
+#define __native_avr_pgmspace_h_included__
+
+#include <stdint.h>
+
+uint8_t native_pgm_read_byte(uintptr_t aAddress);
+
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define pgm_read_byte(address)  native_pgm_read_byte((uintptr_t) (address))
+#define pgm_read_word(address)  ((uint16_t) (pgm_read_byte(address) | (pgm_read_byte((uintptr_t) (address) + 1) << 8)))
+
+#endif /* __native_avr_pgmspace_h_included__ */
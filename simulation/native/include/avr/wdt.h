@@ -0,0 +1,11 @@
+/* Name: avr/wdt.h
+ * Project: Micronucleus native build
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_avr_wdt_h_included__
+#define __native_avr_wdt_h_included__
+
+#define wdt_reset()
+#define wdt_disable()
+
+#endif /* __native_avr_wdt_h_included__ */
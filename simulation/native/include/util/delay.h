@@ -0,0 +1,16 @@
+/* Name: util/delay.h
+ * Project: Micronucleus native build
+ *
+ * Busy waits only advance the simulated time.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_util_delay_h_included__
+#define __native_util_delay_h_included__
+
+void native_delay_us(double aMicroseconds);
+
+#define _delay_us(us)   native_delay_us(us)
+#define _delay_ms(ms)   native_delay_us((ms) * 1000.0)
+
+#endif /* __native_util_delay_h_included__ */
@@ -0,0 +1,529 @@
+/* Name: mnnative.c
+ * Project: Micronucleus native build
+ *
+ * Host side driver for the natively compiled bootloader.
+ * Uploads an Intel HEX file or a generated test image the same way the
+ * micronucleus command line tool does it, then reports the modeled upload
+ * time, the USB and flash statistics and verifies the resulting flash content.
+ *
+ * With -i, the programmed device is then started three more times without uploading,
+ * to measure the idle exit times with a host resetting it, without a host
+ * and with a host suspending the bus for a second after the reset.
+ *
+ * With ENABLE_BOOTLOADER_HASH, the bootloader area of the flash model is filled with pseudo random data
+ * and the hash returned by the bootloader is compared with the one computed here over the linked bootloader,
+ * without the stale data behind it.
+ *
+ * With -r and a bootloader compiled with ENABLE_TRACE, the trace buffer of the bootloader is read
+ * after the erase and after every page and the new entries are printed on the time line of the host.
+ *
+ * With -u and a bootloader compiled with ENABLE_SELF_UPDATE, a new bootloader is staged in the application area
+ * instead of a program. It shares the first page with the bootloader in the flash model and has pseudo random data
+ * after it. cmd_self_update must reject it with a wrong CRC and copy it over the bootloader with the right one.
+ *
+ * With -l, the host behaves like a host without support for cmd_get_status. It only waits the fixed erase time
+ * and never polls, even if the bootloader reports FEATURE_INTERLEAVED_ERASE.
+ *
+ * Usage: mnnative [-t halt_us] [-s image_size] [-q] [-i] [-r] [-u] [-l] [file.hex]
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "native_avr.h"
+#include "mnhexfile.h"
+
+#define CONNECT_DELAY_MS    100     // time the host waits after the device connected before it resets it
+#define BUS_RESET_MS        65      // observed duration of a host reset
+#define RESET_RECOVERY_MS   10
+#define SUSPEND_MS          1000    // duration of the bus suspend of the idle exit test
+#define SUSPEND_STEPS       20      // the suspend is repeated 0.25 ms longer each time, so the resume hits every phase of the 5 ms loop
+#define RESUME_RECOVERY_MS  10
+#define EXIT_TIMEOUT_MS     1000
+#define TRANSFER_RETRIES    5       // the command line tool repeats failed requests
+
+// Protocol, see firmware/main.c
+#define CMD_DEVICE_INFO     0
+#define CMD_TRANSFER_PAGE   1
+#define CMD_ERASE_APP       2
+#define CMD_WRITE_DATA      3
+#define CMD_EXIT            4
+#define CMD_GET_STATUS      5
+#define CMD_GET_DIAGNOSTICS 6
+#define CMD_GET_TRACE       7
+#define CMD_GET_BOOTLOADER_HASH 8
+#define CMD_SELF_UPDATE     9
+
+#define FEATURE_INTERLEAVED_ERASE   0x02
+#define FEATURE_DIAGNOSTICS         0x04
+#define DIAGNOSTICS_LENGTH          10
+#define FEATURE_TRACE               0x08
+#define FEATURE_SERIAL_NUMBER       0x10
+#define SERIAL_NUMBER_LENGTH_MAX    32
+#define DESCRIPTOR_DEVICE           1
+#define DESCRIPTOR_STRING           3
+#define DEVICE_SERIAL_NUMBER_INDEX  16      // offset of iSerialNumber in the device descriptor
+#define FEATURE_BOOTLOADER_HASH     0x20
+#define BOOTLOADER_HASH_LENGTH      10
+#define FEATURE_SELF_UPDATE         0x40
+#define TRACE_LENGTH_MAX            255     // 3 + 3 * ODTRACE_ENTRIES, see firmware/usbdrv/oddebug.h
+#define TRACE_TICK_CYCLES           1024    // Timer0 prescaler of the time stamps
+
+static uint8_t sImage[0x10000];
+static uint32_t sImageSize;
+static uint8_t sQuiet;
+static uint8_t sTrace;
+static uint8_t sTraceCount;             // entries already printed, modulo 256
+static uint64_t sTraceStartCycles[2];   // start of the current erase and write, 0 if none
+static uint64_t sTraceCycles[2];        // sum of the erase and write times
+static uint8_t sIdleExitTest;
+static uint8_t sSelfUpdateTest;
+static uint8_t sLegacyHost;
+
+static double cyclesToMillis(uint64_t aCycles) {
+    return aCycles * 1000.0 / NativeTarget.cpuFrequency;
+}
+
+/*
+ * CRC-32 as used by zlib, see initBootloaderHash() in firmware/main.c
+ */
+static uint32_t crc32(const uint8_t *aData, uint32_t aLength) {
+    uint32_t tCrc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < aLength; i++) {
+        tCrc ^= aData[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            tCrc = (tCrc & 1) ? (tCrc >> 1) ^ 0xEDB88320 : tCrc >> 1;
+        }
+    }
+    return ~tCrc;
+}
+
+/*
+ * Generates a program starting with a rjmp over the vector table, followed by pseudo random data
+ */
+static void generateImage(uint32_t aSize) {
+    uint32_t tSeed = 0x12345678;
+    for (uint32_t i = 0; i < aSize; i++) {
+        tSeed = tSeed * 1103515245 + 12345;
+        sImage[i] = tSeed >> 16;
+    }
+    sImage[0] = 0x0E; // rjmp .+30
+    sImage[1] = 0xC0;
+    sImageSize = aSize;
+}
+
+static int controlOut(uint8_t aRequest, uint16_t aValue, uint16_t aIndex) {
+    for (int i = 0; i < TRANSFER_RETRIES; i++) {
+        if (host_control_out(aRequest, aValue, aIndex) >= 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Stages a new bootloader at the second page, behind a page 0 which jumps to the bootloader.
+ * Its first page is the one of the current bootloader, which holds the copy routine, see firmware/crt1.S.
+ * The ATtiny25/45/85 of the register model erase single pages.
+ */
+static void generateSelfUpdateImage(uint16_t aBootloaderAddress, uint16_t aPageSize) {
+    uint32_t tLength = NativeTarget.flashSize - aBootloaderAddress;
+    memset(sImage, 0xFF, sizeof(sImage));
+    uint16_t tBootloaderJump = 0xC000 | ((aBootloaderAddress / 2 - 1) & 0x0FFF);
+    sImage[0] = tBootloaderJump & 0xFF;
+    sImage[1] = tBootloaderJump >> 8;
+    memcpy(&sImage[aPageSize], native_flash() + aBootloaderAddress, aPageSize);
+    uint32_t tSeed = 0x2468ACE1;
+    for (uint32_t i = aPageSize; i < tLength; i++) {
+        tSeed = tSeed * 1103515245 + 12345;
+        sImage[aPageSize + i] = tSeed >> 16;
+    }
+    sImageSize = aPageSize + tLength;
+}
+
+/*
+ * Sends cmd_self_update with a wrong CRC, which must be rejected, and then with the right one.
+ * Returns the time from the second request until the device left after the copy, or -1.
+ */
+static int selfUpdateTest(uint16_t aBootloaderAddress, uint16_t aPageSize) {
+    uint32_t tLength = NativeTarget.flashSize - aBootloaderAddress;
+    uint32_t tCrc = crc32(&sImage[aPageSize], tLength);
+    controlOut(CMD_SELF_UPDATE, ~tCrc & 0xFFFF, ~tCrc >> 16);
+    if (host_wait_for_exit(EXIT_TIMEOUT_MS) >= 0) {
+        printf("%s: self update with wrong CRC was not rejected\n", NativeTarget.name);
+        return -1;
+    }
+    controlOut(CMD_SELF_UPDATE, tCrc & 0xFFFF, tCrc >> 16);
+    int tMicros = host_wait_for_exit(EXIT_TIMEOUT_MS);
+    if (tMicros >= 0 && memcmp(native_flash() + aBootloaderAddress, &sImage[aPageSize], tLength) != 0) {
+        printf("%s: bootloader differs from the staged one after self update\n", NativeTarget.name);
+        return -1;
+    }
+    return tMicros;
+}
+
+static int pageHasData(uint32_t aAddress, uint16_t aPageSize) {
+    for (uint32_t i = aAddress; i < aAddress + aPageSize && i < sImageSize; i++) {
+        if (sImage[i] != 0xFF) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start the programmed device with a host, which resets it but sends no request, without a host
+ * and with a host, which suspends the bus for SUSPEND_STEPS different durations.
+ * Reports the time from start of the bootloader until it jumps to the user program, for the suspend only of the first duration.
+ */
+static int idleExitTest(void) {
+    static const char *const sScenario[] = { "with host", "without host", "with suspending host" };
+    int tResult = 0;
+    for (uint8_t tRun = 0; tRun < 2 + SUSPEND_STEPS; tRun++) {
+        uint8_t tScenario = tRun < 2 ? tRun : 2;
+        double tSuspendMs = SUSPEND_MS + (tRun - tScenario) * 0.25;
+        native_reset(NativeTarget.entryMcusr);
+        NativeUsbStats.lowClockCycles = 0;
+        host_start();
+        if (tScenario != 1) {
+            host_wait_us(CONNECT_DELAY_MS * 1000.0);
+            host_bus_reset(BUS_RESET_MS);
+        }
+        if (tScenario == 2) {
+            // Suspend the bus for around a second, the device must answer directly after resume
+            host_wait_us(RESET_RECOVERY_MS * 1000.0);
+            host_suspend(tSuspendMs);
+            host_wait_us(RESUME_RECOVERY_MS * 1000.0);
+            uint8_t tInfo[6];
+            if (host_control_in(CMD_DEVICE_INFO, 0, 0, tInfo, sizeof(tInfo)) != sizeof(tInfo)) {
+                printf("%s: no answer after resume from %.2f ms suspend\n", NativeTarget.name, tSuspendMs);
+                tResult = 1;
+            }
+        }
+        int tMicros = host_wait_for_exit(20000);
+        if (tMicros < 0) {
+            printf("%s: no exit %s within 20 s\n", NativeTarget.name, sScenario[tScenario]);
+            tResult = 1;
+        } else if (tRun <= 2) {
+            printf("%s: idle exit %s after %.1f ms, %.1f ms with low clock\n", NativeTarget.name, sScenario[tScenario],
+                    cyclesToMillis(native_now()), cyclesToMillis(NativeUsbStats.lowClockCycles));
+        }
+    }
+    return tResult;
+}
+
+static const char* traceEventName(uint8_t aPrefix) {
+    static const char *sNames[] = { "-", "erase start", "erase end", "write start", "write end", "collision", "reset" };
+    static char sSetupName[20];
+    if (aPrefix < sizeof(sNames) / sizeof(sNames[0])) {
+        return sNames[aPrefix];
+    }
+    snprintf(sSetupName, sizeof(sSetupName), "%s setup %u", (aPrefix & 0xF0) == 0x20 ? "standard" : "vendor",
+            aPrefix & 0x0F);
+    return sSetupName;
+}
+
+/*
+ * Reads the trace buffer and prints the entries since the last call. The 16 bit time stamps are related
+ * to the current time stamp of the reply, so they can be printed as host time.
+ * If more than ODTRACE_ENTRIES were recorded since the last call, the oldest are lost.
+ */
+static void readTrace(uint64_t aStartCycles) {
+    uint8_t tTrace[TRACE_LENGTH_MAX];
+    int tLength = host_control_in(CMD_GET_TRACE, 0, 0, tTrace, sizeof(tTrace));
+    if (tLength < 6) {
+        printf("  trace not received\n");
+        return;
+    }
+    uint64_t tNow = native_now();
+    uint16_t tTime = tTrace[0] | (tTrace[1] << 8);
+    uint8_t tEntries = (tLength - 3) / 3;
+    uint8_t tNew = tTrace[2] - sTraceCount;
+    if (tNew > tEntries) {
+        printf("  %u entries lost\n", tNew - tEntries);
+        sTraceCount = tTrace[2] - tEntries;
+    }
+    for (; sTraceCount != tTrace[2]; sTraceCount++) {
+        uint8_t *tEntry = &tTrace[3 + 3 * (sTraceCount % tEntries)];
+        uint16_t tAge = tTime - (tEntry[1] | (tEntry[2] << 8));
+        uint64_t tCycles = tNow - (uint64_t) tAge * TRACE_TICK_CYCLES;
+        printf("  %9.2f ms  %s\n", (double) ((int64_t) (tCycles - aStartCycles)) * 1000.0 / NativeTarget.cpuFrequency,
+                traceEventName(tEntry[0]));
+        if (tEntry[0] >= 1 && tEntry[0] <= 4) {
+            uint8_t tPhase = (tEntry[0] - 1) / 2; // 0 = erase, 1 = write
+            if (tEntry[0] & 1) {
+                sTraceStartCycles[tPhase] = tCycles;
+            } else if (sTraceStartCycles[tPhase]) {
+                sTraceCycles[tPhase] += tCycles - sTraceStartCycles[tPhase];
+                sTraceStartCycles[tPhase] = 0;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int tOption;
+    uint32_t tGeneratedSize = 0;
+    while ((tOption = getopt(argc, argv, "t:s:qirul")) != -1) {
+        switch (tOption) {
+        case 't':
+            NativeSpmHaltMicros = atof(optarg);
+            break;
+        case 's':
+            tGeneratedSize = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            sQuiet = 1;
+            break;
+        case 'i':
+            sIdleExitTest = 1;
+            break;
+        case 'r':
+            sTrace = 1;
+            break;
+        case 'u':
+            sSelfUpdateTest = 1;
+            break;
+        case 'l':
+            sLegacyHost = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t halt_us] [-s image_size] [-q] [-i] [-r] [-u] [-l] [file.hex]\n", argv[0]);
+            return 2;
+        }
+    }
+    memset(sImage, 0xFF, sizeof(sImage));
+    if (optind < argc) {
+        if (mnhex_read(argv[optind], sImage, sizeof(sImage), &sImageSize) < 0) {
+            return 2;
+        }
+    } else {
+        generateImage(tGeneratedSize ? tGeneratedSize : 4096);
+    }
+
+    memset(native_flash(), 0xFF, NativeTarget.flashSize);
+    // Stands for the code of the bootloader up to bootloaderEnd, which is covered by cmd_get_bootloader_hash, and the tail
+    // of an older bootloader behind it
+    uint32_t tSeed = 0x87654321;
+    for (uint32_t i = NativeTarget.bootloaderAddress; i < NativeTarget.flashSize; i++) {
+        tSeed = tSeed * 1103515245 + 12345;
+        native_flash()[i] = tSeed >> 16;
+    }
+    native_reset(NativeTarget.entryMcusr);
+    host_start();
+    host_wait_us(CONNECT_DELAY_MS * 1000.0);
+    host_bus_reset(BUS_RESET_MS);
+    host_wait_us(RESET_RECOVERY_MS * 1000.0);
+    uint64_t tStart = native_now();
+
+    uint8_t tInfo[8];
+    int tInfoLength = -1;
+    for (int i = 0; i < TRANSFER_RETRIES && tInfoLength < 6; i++) {
+        tInfoLength = host_control_in(CMD_DEVICE_INFO, 0, 0, tInfo, sizeof(tInfo));
+    }
+    if (tInfoLength < 6) {
+        fprintf(stderr, "No device info received\n");
+        return 1;
+    }
+    uint16_t tProgramSize = (tInfo[0] << 8) | tInfo[1];
+    uint16_t tPageSize = tInfo[2] ? tInfo[2] : 256;
+    uint8_t tWriteSleep = tInfo[3] & 0x7F;
+    uint8_t tEraseSleep = (tInfo[3] & 0x80) ? tWriteSleep / 4 : tWriteSleep;
+    uint16_t tBootloaderAddress = (tProgramSize + tPageSize - 1) & ~(tPageSize - 1);
+    uint8_t tFeatures = (tInfoLength > 6) ? tInfo[6] : 0;
+    if (sSelfUpdateTest) {
+        if (!(tFeatures & FEATURE_SELF_UPDATE)) {
+            fprintf(stderr, "Bootloader is not compiled with ENABLE_SELF_UPDATE\n");
+            return 1;
+        }
+        generateSelfUpdateImage(tBootloaderAddress, tPageSize);
+    }
+    if (sImageSize > tProgramSize) {
+        fprintf(stderr, "Image of %u bytes does not fit into %u bytes\n", sImageSize, tProgramSize);
+        return 1;
+    }
+
+    uint8_t tHash[BOOTLOADER_HASH_LENGTH];
+    int tHashLength = -1;
+    if (tFeatures & FEATURE_BOOTLOADER_HASH) {
+        for (int i = 0; i < TRANSFER_RETRIES && tHashLength < BOOTLOADER_HASH_LENGTH; i++) {
+            tHashLength = host_control_in(CMD_GET_BOOTLOADER_HASH, 0, 0, tHash, sizeof(tHash));
+        }
+        uint16_t tHashed = tHash[8] | (tHash[9] << 8);
+        uint32_t tCrc = tHash[0] | (tHash[1] << 8) | (tHash[2] << 16) | ((uint32_t) tHash[3] << 24);
+        if (tHashLength < BOOTLOADER_HASH_LENGTH || tHashed != NativeTarget.bootloaderEnd - NativeTarget.bootloaderAddress
+                || tCrc != crc32(native_flash() + NativeTarget.bootloaderAddress, tHashed)) {
+            fprintf(stderr, "Wrong bootloader hash received\n");
+            return 1;
+        }
+    }
+
+    // Move the user reset vector to the postscript and let page 0 jump to the bootloader, as the command line tool does
+    uint16_t tUserReset = ((sImage[1] << 8) | sImage[0]);
+    uint16_t tUserResetTarget = ((tUserReset & 0x0FFF) + 1) * 2;
+    uint16_t tPostscript = tBootloaderAddress - 4;
+    uint16_t tPostscriptJump = 0xC000 | ((((tUserResetTarget - tPostscript - 2) / 2)) & 0x0FFF);
+    uint16_t tBootloaderJump = 0xC000 | ((tBootloaderAddress / 2 - 1) & 0x0FFF);
+    uint32_t tImageBytes = sImageSize;
+    uint8_t tExpected[0x10000];
+    memcpy(tExpected, sImage, sizeof(tExpected));
+    tExpected[0] = tBootloaderJump & 0xFF;
+    tExpected[1] = tBootloaderJump >> 8;
+    if (!sSelfUpdateTest) { // the new bootloader must find no program and stay
+        tExpected[tPostscript] = tPostscriptJump & 0xFF;
+        tExpected[tPostscript + 1] = tPostscriptJump >> 8;
+        if (sImageSize < tPostscript + 2U) {
+            sImageSize = tPostscript + 2;
+        }
+    }
+
+    uint16_t tPages = tBootloaderAddress / tPageSize;
+    controlOut(CMD_ERASE_APP, 0, 0);
+    if ((tFeatures & FEATURE_INTERLEAVED_ERASE) && !sLegacyHost) {
+        // Poll until all pages are erased. The device erases only if it was idle for a frame, so wait between the polls.
+        uint8_t tRemaining = 0xFF;
+        while (tRemaining) {
+            if (host_control_in(CMD_GET_STATUS, 0, 0, &tRemaining, 1) < 1) {
+                tRemaining = 0xFF; // poll was lost during a page erase
+                host_wait_us(2000);
+            } else if (tRemaining) {
+                host_wait_us(tRemaining > 1 ? (tRemaining - 1) * tEraseSleep * 1000.0 : 2000);
+            }
+        }
+    } else {
+        host_wait_us(tEraseSleep * tPages * 1000.0);
+    }
+    uint64_t tEraseEnd = native_now();
+    if (!(tFeatures & FEATURE_TRACE)) {
+        sTrace = 0;
+    }
+    if (sTrace) {
+        printf("Trace, times since the first request\n");
+        readTrace(tStart);
+    }
+
+    uint16_t tPagesWritten = 0;
+    for (uint32_t tAddress = 0; tAddress < tBootloaderAddress; tAddress += tPageSize) {
+        if (tAddress != 0 && tAddress + tPageSize < tBootloaderAddress && !pageHasData(tAddress, tPageSize)) {
+            continue;
+        }
+        if (controlOut(CMD_TRANSFER_PAGE, tPageSize, tAddress) < 0) {
+            fprintf(stderr, "Transfer of page 0x%04X failed\n", tAddress);
+            return 1;
+        }
+        for (uint32_t i = tAddress; i < tAddress + tPageSize; i += 4) {
+            uint16_t tWord0 = tExpected[i] | (tExpected[i + 1] << 8);
+            uint16_t tWord1 = tExpected[i + 2] | (tExpected[i + 3] << 8);
+            if (controlOut(CMD_WRITE_DATA, tWord0, tWord1) < 0) {
+                fprintf(stderr, "Write to page 0x%04X failed\n", tAddress);
+                return 1;
+            }
+        }
+        host_wait_us(tWriteSleep * 1000.0);
+        tPagesWritten++;
+        if (sTrace) {
+            readTrace(tStart);
+        }
+    }
+    uint64_t tWriteEnd = native_now();
+
+    uint8_t tDiagnostics[DIAGNOSTICS_LENGTH];
+    int tDiagnosticsLength = -1;
+    if (tFeatures & FEATURE_DIAGNOSTICS) {
+        for (int i = 0; i < TRANSFER_RETRIES && tDiagnosticsLength < DIAGNOSTICS_LENGTH; i++) {
+            tDiagnosticsLength = host_control_in(CMD_GET_DIAGNOSTICS, 0, 0, tDiagnostics, sizeof(tDiagnostics));
+        }
+    }
+
+    char tSerialNumber[SERIAL_NUMBER_LENGTH_MAX + 1] = "";
+    if (tFeatures & FEATURE_SERIAL_NUMBER) {
+        uint8_t tDevice[18];
+        uint8_t tString[2 + 2 * SERIAL_NUMBER_LENGTH_MAX];
+        int tLength = -1;
+        if (host_get_descriptor(DESCRIPTOR_DEVICE, 0, tDevice, sizeof(tDevice)) == sizeof(tDevice)
+                && tDevice[DEVICE_SERIAL_NUMBER_INDEX]) {
+            tLength = host_get_descriptor(DESCRIPTOR_STRING, tDevice[DEVICE_SERIAL_NUMBER_INDEX], tString, sizeof(tString));
+        }
+        // UTF-16LE, only ASCII digits are expected
+        for (int i = 2; i + 1 < tLength && i < tString[0]; i += 2) {
+            tSerialNumber[i / 2 - 1] = tString[i];
+        }
+    }
+
+    int tExitMicros;
+    if (sSelfUpdateTest) {
+        tExitMicros = selfUpdateTest(tBootloaderAddress, tPageSize);
+    } else {
+        controlOut(CMD_EXIT, 0, 0);
+        tExitMicros = host_wait_for_exit(EXIT_TIMEOUT_MS);
+    }
+
+    uint8_t *tFlash = native_flash();
+    uint32_t tMismatches = 0;
+    for (uint32_t i = 0; i < tBootloaderAddress - 4U; i++) {
+        if (i >= tPostscript - 2U) {
+            break; // OSCCAL_SAVE_CALIB replaces the word before the user reset vector by the calibration value
+        }
+        uint8_t tWanted = (i < sImageSize) ? tExpected[i] : 0xFF;
+        if (tFlash[i] != tWanted) {
+            tMismatches++;
+        }
+    }
+    if (tFlash[tPostscript] != tExpected[tPostscript] || tFlash[tPostscript + 1] != tExpected[tPostscript + 1]) {
+        tMismatches++;
+    }
+
+    double tTotal = cyclesToMillis(native_now() - tStart);
+    if (!sQuiet) {
+        printf("Configuration %s: %.3f MHz, bootloader at 0x%04X, page size %u\n", NativeTarget.name,
+                NativeTarget.cpuFrequency / 1e6, NativeTarget.bootloaderAddress, NativeTarget.pageSize);
+        printf("Image %u bytes, %u pages written\n", tImageBytes, tPagesWritten);
+        printf("  erase     %8.1f ms\n", cyclesToMillis(tEraseEnd - tStart));
+        printf("  write     %8.1f ms\n", cyclesToMillis(tWriteEnd - tEraseEnd));
+        printf("  %s %8.1f ms\n", sSelfUpdateTest ? "update   " : "exit     ", tExitMicros < 0 ? -1.0 : tExitMicros / 1000.0);
+        printf("  total     %8.1f ms, %.0f bytes/s\n", tTotal, tPagesWritten * tPageSize * 1000.0 / tTotal);
+        printf("USB: %u transfers, %u packets lost, %u NAKs, %.1f ms with low clock\n", NativeUsbStats.transfers,
+                NativeUsbStats.packetsLost, NativeUsbStats.naks, cyclesToMillis(NativeUsbStats.lowClockCycles));
+        printf("Commands: %u info, %u transfer page, %u erase, %u write data, %u exit, %u status\n",
+                NativeUsbStats.requests[CMD_DEVICE_INFO], NativeUsbStats.requests[CMD_TRANSFER_PAGE],
+                NativeUsbStats.requests[CMD_ERASE_APP], NativeUsbStats.requests[CMD_WRITE_DATA],
+                NativeUsbStats.requests[CMD_EXIT], NativeUsbStats.requests[CMD_GET_STATUS]);
+        printf("Flash: %u page erases, %u page writes, at most %u writes per page, CPU halted %.1f ms\n",
+                NativeFlashStats.pageErases, NativeFlashStats.pageWrites, NativeFlashStats.maxWritesPerPage,
+                cyclesToMillis(NativeFlashStats.haltCycles));
+        if (sTrace) {
+            printf("Traced: erase %.1f ms, page writes %.1f ms\n", cyclesToMillis(sTraceCycles[0]),
+                    cyclesToMillis(sTraceCycles[1]));
+        }
+        if (tDiagnosticsLength == DIAGNOSTICS_LENGTH) {
+            // The assembler counters (NAKs, overflows, ignored packets) stay 0, the packet feeder replaces the assembler part
+            printf("Device: %u setups, %u collisions, %u resets, %u calibrations, OSCCAL 0x%02X\n",
+                    tDiagnostics[6] | (tDiagnostics[7] << 8), tDiagnostics[8] | (tDiagnostics[9] << 8), tDiagnostics[3],
+                    tDiagnostics[4], tDiagnostics[5]);
+        }
+        if (tFeatures & FEATURE_SERIAL_NUMBER) {
+            printf("Serial number: %s\n", tSerialNumber[0] ? tSerialNumber : "not received");
+        }
+        if (tHashLength == BOOTLOADER_HASH_LENGTH) {
+            printf("Bootloader hash: CRC-32 0x%02X%02X%02X%02X of %u bytes, configuration 0x%02X%02X%02X%02X\n", tHash[3],
+                    tHash[2], tHash[1], tHash[0], tHash[8] | (tHash[9] << 8), tHash[7], tHash[6], tHash[5], tHash[4]);
+        }
+    }
+    if (tExitMicros < 0) {
+        printf("Bootloader did not exit\n");
+        return 1;
+    }
+    if (tMismatches) {
+        printf("Verify failed: %u bytes differ\n", tMismatches);
+        return 1;
+    }
+    printf("%s: %.1f ms, %u packets lost, verify OK\n", NativeTarget.name, tTotal, NativeUsbStats.packetsLost);
+    if (sIdleExitTest) {
+        return idleExitTest();
+    }
+    return 0;
+}
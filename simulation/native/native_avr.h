@@ -0,0 +1,80 @@
+/* Name: native_avr.h
+ * Project: Micronucleus native build
+ *
+ * Interface between the natively compiled bootloader (bootloader_native.c)
+ * and the host side driver (mnnative.c).
+ *
+ * The bootloader runs in its own coroutine. It gives control back to the host
+ * side at its polling points (reads of USBIN and of the pin change flag), when
+ * the host side wake up time is reached, a transaction is finished, or the
+ * bootloader has left to the user program.
+ *
+ * Time is counted in CPU cycles. Polling the bus costs the cycles of the real
+ * wait loop, SPM erase and write operations halt the CPU for the configured time.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef __native_avr_h_included__
+#define __native_avr_h_included__
+
+#include <stdint.h>
+
+#define NATIVE_SPM_HALT_US_DEFAULT  4500.0  // ATtiny datasheets: 4.5 ms for page erase and page write
+
+typedef struct {
+    uint32_t pageErases;
+    uint32_t pageWrites;
+    uint32_t wordFills;
+    uint32_t maxWritesPerPage;  // highest number of page writes to the same page
+    uint64_t haltCycles;        // cycles the CPU was halted by SPM operations
+} native_flash_stats_t;
+
+#define NATIVE_REQUEST_COUNT    16
+
+typedef struct {
+    uint32_t transfers;         // control transfers started by the host
+    uint32_t requests[NATIVE_REQUEST_COUNT]; // transfers per request number, i.e. per micronucleus command
+    uint32_t packetsLost;       // packets the bootloader did not receive, because it was halted or busy
+    uint32_t naks;              // IN tokens answered with NAK
+    uint64_t cycles;            // current device time
+    uint64_t lowClockCycles;    // device time spent polling with divided system clock
+} native_usb_stats_t;
+
+typedef struct {
+    const char *name;           // configuration name, from Makefile
+    uint32_t cpuFrequency;
+    uint16_t bootloaderAddress;
+    uint16_t bootloaderEnd;     // end of the linked bootloader, the hash of ENABLE_BOOTLOADER_HASH covers it
+    uint16_t flashSize;
+    uint16_t pageSize;
+    uint8_t entryMcusr;         // reset flags which start the bootloader even if a user program exists
+} native_target_t;
+
+extern const native_target_t NativeTarget;
+extern native_flash_stats_t NativeFlashStats;
+extern native_usb_stats_t NativeUsbStats;
+extern double NativeSpmHaltMicros;
+
+/*
+ * Device side
+ */
+void native_reset(uint8_t aMcusr);
+uint8_t *native_flash(void);
+uint64_t native_now(void);
+uint8_t native_has_left_bootloader(void);
+
+/*
+ * Host side. All functions block until the bootloader reached the corresponding point in time.
+ * Transfer functions return the number of bytes received or -1 if the packet was lost.
+ * host_start() returns when the bootloader has connected, i.e. after the initial reconnect delay.
+ */
+void host_start(void);
+void host_wait_us(double aMicroseconds);
+void host_bus_reset(double aMilliseconds);
+void host_suspend(double aMilliseconds); // stops the keep-alive for aMilliseconds, then resumes with 20 ms K
+int host_control_in(uint8_t aRequest, uint16_t aValue, uint16_t aIndex, uint8_t *aBuffer, uint8_t aLength);
+int host_control_out(uint8_t aRequest, uint16_t aValue, uint16_t aIndex);
+int host_get_descriptor(uint8_t aType, uint8_t aIndex, uint8_t *aBuffer, uint8_t aLength);
+int host_wait_for_exit(double aTimeoutMilliseconds);
+
+#endif /* __native_avr_h_included__ */
@@ -0,0 +1,239 @@
+/* Name: mncompress.c
+ * Project: Micronucleus upgrade compression
+ *
+ * Compresses the binary of a bootloader for embedding into upgrade.hex, see COMPRESS_UPGRADE in firmware/Makefile.
+ * The format is a byte oriented LZ77 variant, which is expanded by a decompressor of a few dozen instructions
+ * in firmware/upgrade.c:
+ *   0x00 to 0x7F  token of a literal run, followed by token + 1 literal bytes
+ *   0x80 to 0xBF  token of a near match of (token & 0x3F) + 3 bytes, followed by distance - 1 as 8 bit value
+ *   0xC0 to 0xFF  token of a far match of (token & 0x3F) + 4 bytes, followed by distance - 1 as 16 bit
+ *                 little endian value
+ * A match is copied from distance bytes before the current output position, it may overlap the output,
+ * e.g. a distance of 1 repeats the last byte.
+ * The size of the expanded data is not stored in the stream, upgrade.c gets it from bootloader.h.
+ * The result is expanded again and compared with the input before it is written.
+ *
+ * The optional size file receives the size of the input and the POSIX cksum of the output as two decimal numbers,
+ * for bootloader.h. So the firmware Makefile needs neither wc nor cksum, which windows_exe does not have.
+ *
+ * Usage: mncompress input.bin output.lz [output.sum]
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NEAR_MIN_MATCH  3       // a near match costs 2 bytes
+#define NEAR_DISTANCE   0x100
+#define FAR_MIN_MATCH   4       // a far match costs 3 bytes
+#define FAR_DISTANCE    0x10000
+#define MATCH_LENGTHS   0x40
+#define MAX_LITERALS    0x80
+#define INPUT_SIZE_MAX  0x10000 // the bootloader must fit into the 64 kB addressed by the upgrader
+
+typedef struct {
+    int length;
+    int distance;
+    int gain;   // bytes saved compared to literals, without the token of the literal run
+} match_t;
+
+/*
+ * Finds the longest match for the data at aPosition within aMaxDistance, the nearest one if there are several
+ */
+static int findLongest(const uint8_t *aInput, int aSize, int aPosition, int aMaxDistance, int aMaxLength,
+        int *aDistance) {
+    int tBestLength = 0;
+    int tMaxLength = aSize - aPosition;
+    if (tMaxLength > aMaxLength) {
+        tMaxLength = aMaxLength;
+    }
+    for (int tDistance = 1; tDistance <= aPosition && tDistance <= aMaxDistance; tDistance++) {
+        int tLength = 0;
+        while (tLength < tMaxLength && aInput[aPosition + tLength] == aInput[aPosition + tLength - tDistance]) {
+            tLength++;
+        }
+        if (tLength > tBestLength) {
+            tBestLength = tLength;
+            *aDistance = tDistance;
+            if (tLength == tMaxLength) {
+                break;
+            }
+        }
+    }
+    return tBestLength;
+}
+
+/*
+ * Chooses between the best near and the best far match at aPosition
+ */
+static match_t findMatch(const uint8_t *aInput, int aSize, int aPosition) {
+    match_t tMatch = { 0, 0, 0 };
+    int tDistance = 0;
+    int tLength = findLongest(aInput, aSize, aPosition, NEAR_DISTANCE, MATCH_LENGTHS - 1 + NEAR_MIN_MATCH, &tDistance);
+    if (tLength >= NEAR_MIN_MATCH) {
+        tMatch = (match_t) { tLength, tDistance, tLength - 2 };
+    }
+    tLength = findLongest(aInput, aSize, aPosition, FAR_DISTANCE, MATCH_LENGTHS - 1 + FAR_MIN_MATCH, &tDistance);
+    if (tLength >= FAR_MIN_MATCH && tLength - 3 > tMatch.gain) {
+        tMatch = (match_t) { tLength, tDistance, tLength - 3 };
+    }
+    return tMatch;
+}
+
+static int flushLiterals(const uint8_t *aInput, int aStart, int aEnd, uint8_t *aOutput, int aOutputSize) {
+    while (aStart < aEnd) {
+        int tCount = aEnd - aStart;
+        if (tCount > MAX_LITERALS) {
+            tCount = MAX_LITERALS;
+        }
+        aOutput[aOutputSize++] = tCount - 1;
+        memcpy(&aOutput[aOutputSize], &aInput[aStart], tCount);
+        aOutputSize += tCount;
+        aStart += tCount;
+    }
+    return aOutputSize;
+}
+
+/*
+ * Greedy parse with one step of lazy matching: a match is deferred, if the next position has a longer one
+ */
+static int compress(const uint8_t *aInput, int aSize, uint8_t *aOutput) {
+    int tOutputSize = 0;
+    int tLiteralStart = 0;
+    int tPosition = 0;
+    while (tPosition < aSize) {
+        match_t tMatch = findMatch(aInput, aSize, tPosition);
+        if (tMatch.gain <= 0
+                || (tPosition + 1 < aSize && findMatch(aInput, aSize, tPosition + 1).gain > tMatch.gain)) {
+            tPosition++;
+            continue;
+        }
+        tOutputSize = flushLiterals(aInput, tLiteralStart, tPosition, aOutput, tOutputSize);
+        if (tMatch.distance <= NEAR_DISTANCE && tMatch.gain == tMatch.length - 2) {
+            aOutput[tOutputSize++] = 0x80 | (tMatch.length - NEAR_MIN_MATCH);
+            aOutput[tOutputSize++] = tMatch.distance - 1;
+        } else {
+            aOutput[tOutputSize++] = 0xC0 | (tMatch.length - FAR_MIN_MATCH);
+            aOutput[tOutputSize++] = (tMatch.distance - 1) & 0xFF;
+            aOutput[tOutputSize++] = (tMatch.distance - 1) >> 8;
+        }
+        tPosition += tMatch.length;
+        tLiteralStart = tPosition;
+    }
+    return flushLiterals(aInput, tLiteralStart, aSize, aOutput, tOutputSize);
+}
+
+/*
+ * Same algorithm as in firmware/upgrade.c, returns the number of bytes expanded or -1 for a corrupt stream
+ */
+static int expand(const uint8_t *aInput, int aSize, uint8_t *aOutput, int aOutputSizeMax) {
+    int tInputIndex = 0;
+    int tOutputSize = 0;
+    while (tInputIndex < aSize) {
+        uint8_t tToken = aInput[tInputIndex++];
+        if (tToken < 0x80) {
+            int tCount = tToken + 1;
+            if (tInputIndex + tCount > aSize || tOutputSize + tCount > aOutputSizeMax) {
+                return -1;
+            }
+            memcpy(&aOutput[tOutputSize], &aInput[tInputIndex], tCount);
+            tInputIndex += tCount;
+            tOutputSize += tCount;
+        } else {
+            int tCount = (tToken & 0x3F) + NEAR_MIN_MATCH;
+            if (tInputIndex >= aSize) {
+                return -1;
+            }
+            int tDistance = aInput[tInputIndex++] + 1;
+            if (tToken >= 0xC0) {
+                if (tInputIndex >= aSize) {
+                    return -1;
+                }
+                tDistance += aInput[tInputIndex++] << 8;
+                tCount++;
+            }
+            if (tDistance > tOutputSize || tOutputSize + tCount > aOutputSizeMax) {
+                return -1;
+            }
+            while (tCount-- > 0) {
+                aOutput[tOutputSize] = aOutput[tOutputSize - tDistance];
+                tOutputSize++;
+            }
+        }
+    }
+    return tOutputSize;
+}
+
+/*
+ * CRC of the POSIX cksum command, as checked by payload_intact() of firmware/upgrade.c
+ */
+static uint32_t cksum(const uint8_t *aData, int aLength) {
+    uint32_t tCrc = 0;
+    for (int i = 0; i < aLength + (int) sizeof(int); i++) {
+        uint8_t tByte;
+        if (i < aLength) {
+            tByte = aData[i];
+        } else if ((i - aLength) && !(aLength >> (8 * (i - aLength)))) {
+            break; // the length is appended with as few bytes as possible
+        } else {
+            tByte = aLength >> (8 * (i - aLength));
+        }
+        tCrc ^= (uint32_t) tByte << 24;
+        for (uint8_t j = 0; j < 8; j++) {
+            tCrc = (tCrc & 0x80000000) ? (tCrc << 1) ^ 0x04C11DB7 : tCrc << 1;
+        }
+    }
+    return ~tCrc;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s input.bin output.lz [output.sum]\n", argv[0]);
+        return 2;
+    }
+    FILE *tFile = fopen(argv[1], "rb");
+    if (!tFile) {
+        perror(argv[1]);
+        return 2;
+    }
+    static uint8_t sInput[INPUT_SIZE_MAX + 1];
+    int tSize = fread(sInput, 1, sizeof(sInput), tFile);
+    fclose(tFile);
+    if (tSize > INPUT_SIZE_MAX) {
+        fprintf(stderr, "%s is larger than %d bytes\n", argv[1], INPUT_SIZE_MAX);
+        return 2;
+    }
+
+    // the worst case is one token for every MAX_LITERALS bytes
+    static uint8_t sOutput[INPUT_SIZE_MAX + INPUT_SIZE_MAX / MAX_LITERALS + 1];
+    int tOutputSize = compress(sInput, tSize, sOutput);
+
+    static uint8_t sCheck[INPUT_SIZE_MAX];
+    if (expand(sOutput, tOutputSize, sCheck, sizeof(sCheck)) != tSize || memcmp(sInput, sCheck, tSize) != 0) {
+        fprintf(stderr, "Compressed %s does not expand to the original, nothing written\n", argv[1]);
+        return 1;
+    }
+
+    tFile = fopen(argv[2], "wb");
+    if (!tFile) {
+        perror(argv[2]);
+        return 2;
+    }
+    if (fwrite(sOutput, 1, tOutputSize, tFile) != (size_t) tOutputSize || fclose(tFile) != 0) {
+        perror(argv[2]);
+        return 2;
+    }
+    if (argc == 4) {
+        tFile = fopen(argv[3], "w");
+        if (!tFile || fprintf(tFile, "%d %lu\n", tSize, (unsigned long) cksum(sOutput, tOutputSize)) < 0
+                || fclose(tFile) != 0) {
+            perror(argv[3]);
+            return 2;
+        }
+    }
+    printf("Compressed %s from %d to %d bytes (%d%%)\n", argv[1], tSize, tOutputSize,
+            tSize ? tOutputSize * 100 / tSize : 100);
+    return 0;
+}
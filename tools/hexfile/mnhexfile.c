@@ -0,0 +1,63 @@
+/* Name: mnhexfile.c
+ * Project: Micronucleus host tools
+ *
+ * Intel HEX reader, see mnhexfile.h.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdio.h>
+
+#include "mnhexfile.h"
+
+static int hexByte(const char *aText) {
+    unsigned tValue;
+    if (sscanf(aText, "%2x", &tValue) != 1) {
+        return -1;
+    }
+    return tValue;
+}
+
+/*
+ * Reads data records (type 00) of an Intel HEX file, extended address records are not required for tiny parts.
+ */
+int mnhex_read(const char *aFileName, uint8_t *aImage, uint32_t aImageSize, uint32_t *aSize) {
+    FILE *tFile = fopen(aFileName, "r");
+    if (!tFile) {
+        perror(aFileName);
+        return -1;
+    }
+    char tLine[600];
+    while (fgets(tLine, sizeof(tLine), tFile)) {
+        if (tLine[0] != ':') {
+            continue;
+        }
+        int tLength = hexByte(tLine + 1);
+        int tAddress = (hexByte(tLine + 3) << 8) | hexByte(tLine + 5);
+        int tType = hexByte(tLine + 7);
+        if (tLength < 0 || tAddress < 0 || tType < 0) {
+            fprintf(stderr, "%s: invalid record %s", aFileName, tLine);
+            fclose(tFile);
+            return -1;
+        }
+        if (tType == 1) {
+            break;
+        }
+        if (tType != 0) {
+            continue;
+        }
+        for (int i = 0; i < tLength; i++) {
+            int tByte = hexByte(tLine + 9 + 2 * i);
+            if (tByte < 0 || (uint32_t) (tAddress + i) >= aImageSize) {
+                fprintf(stderr, "%s: invalid record %s", aFileName, tLine);
+                fclose(tFile);
+                return -1;
+            }
+            aImage[tAddress + i] = tByte;
+            if ((uint32_t) (tAddress + i + 1) > *aSize) {
+                *aSize = tAddress + i + 1;
+            }
+        }
+    }
+    fclose(tFile);
+    return 0;
+}
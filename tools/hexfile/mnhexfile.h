@@ -0,0 +1,20 @@
+/* Name: mnhexfile.h
+ * Project: Micronucleus host tools
+ *
+ * Intel HEX reader shared by tools/upload/mnupload and simulation/native/mnnative.
+ * Each of their Makefiles compiles mnhexfile.c together with the tool.
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#ifndef MNHEXFILE_H
+#define MNHEXFILE_H
+
+#include <stdint.h>
+
+/*
+ * Reads the data records of aFileName into aImage of aImageSize bytes, the bytes not in the file are not changed.
+ * *aSize is raised to the end of the highest record. Returns 0 or -1 after printing the error.
+ */
+int mnhex_read(const char *aFileName, uint8_t *aImage, uint32_t aImageSize, uint32_t *aSize);
+
+#endif
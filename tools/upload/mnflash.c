@@ -0,0 +1,425 @@
+/* Name: mnflash.c
+ * Project: Micronucleus upload
+ *
+ * Flashes many devices at once, e.g. dozens of Digispark boards behind the powered hubs of a production line.
+ * All bootloaders enumerate with the same VID/PID of usbconfig.h, so the devices are told apart by their port path.
+ * For every bootloader arriving, a worker process "mnupload -p port_path" is started, so each device is uploaded
+ * independently and the throughput scales with the number of ports and not with the upload time of one device.
+ * A port gets a new worker, when the next bootloader arrives there, i.e. after the next board is plugged in.
+ *
+ * In station mode (-s) a new worker is started for a port as soon as a board passed there. It has libusb
+ * initialized and its hotplug callback registered, when the next board is plugged in, so its first cmd_device_info
+ * is sent directly after the kernel has enumerated the device, without the start time of a worker process.
+ * This keeps the reaction time short also on a busy station, which matters for the short timeouts of the
+ * FAST_EXIT_NO_USB_MS configurations. The first board of each port is handled as without -s.
+ *
+ * For every finished device a line with key=value pairs is printed to stdout
+ *   device port=1-2.4 serial=... result=pass ms=... bytes_per_s=... retries=...
+ *   device port=1-2.3 serial=... result=fail ms=... error="..."       ms is the run time of the worker
+ * and at the end
+ *   summary devices=... passed=... failed=... ms=... devices_per_min=...
+ * The serial number is - if the bootloader has none (ENABLE_SERIAL_NUMBER) or the worker failed before reading it.
+ * With -b the result is skip instead of pass, if the device already has this bootloader and nothing was uploaded.
+ * With -o the complete timing report of mnupload of each device is written to report_dir/port_path-number.txt.
+ *
+ * Usage: mnflash [-n devices] [-t idle_seconds] [-s] [-u mnupload] [-o report_dir] [-d depth] [-b bootloader.hex] [-c cache_dir]
+ *                file.hex
+ *   -n  stop after this number of devices, default is to run until Ctrl-C
+ *   -t  stop after this time without any running worker, default 0 is never
+ *   -s  station mode, keep a waiting worker at every port where a board passed
+ *   -u  path of mnupload, default is mnupload in the directory of mnflash
+ *   -d  maximum number of transfers in flight per device, passed to mnupload
+ *   -b  upload only to devices with another bootloader, passed to mnupload
+ *   -c  directory for the upload plan, passed to mnupload, so only the first worker reads the HEX file
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libusb.h>
+
+#define MICRONUCLEUS_VID    0x16D0
+#define MICRONUCLEUS_PID    0x0753
+#define WORKERS_MAX         128
+#define WORKER_WAIT_S       "10"    // the device is already there when the worker starts
+#define STATION_WAIT_S      "0"     // the worker of the station mode waits forever for the next board
+#define POLL_MS             20
+#define PORT_PATH_LENGTH    32
+#define ERROR_LENGTH        120
+
+typedef struct {
+    char portPath[PORT_PATH_LENGTH];
+    pid_t pid;                  // 0 if the worker has finished
+    uint8_t active;             // 0 while the worker of the station mode waits for the next board
+    int output;                 // read ends of the stdout and stderr pipes of the worker
+    int errors;
+    char *report;
+    size_t reportLength;
+    char error[ERROR_LENGTH];
+    size_t errorLength;
+    double startMillis;
+} worker_t;
+
+static worker_t sWorkers[WORKERS_MAX];
+static char sArrivals[WORKERS_MAX][PORT_PATH_LENGTH];   // port paths from the hotplug callback, started in the main loop
+static uint8_t sArrivalCount;
+static volatile sig_atomic_t sStop;
+
+static double nowMillis(void) {
+    struct timespec tTime;
+    clock_gettime(CLOCK_MONOTONIC, &tTime);
+    return tTime.tv_sec * 1000.0 + tTime.tv_nsec / 1e6;
+}
+
+/*
+ * Port path of the device as used by the kernel, e.g. 1-2.4 for port 4 of the hub at port 2 of bus 1
+ */
+static void getPortPath(libusb_device *aDevice, char *aText, size_t aSize) {
+    uint8_t tPorts[7];
+    int tCount = libusb_get_port_numbers(aDevice, tPorts, sizeof(tPorts));
+    int tLength = snprintf(aText, aSize, "%u", libusb_get_bus_number(aDevice));
+    for (int i = 0; i < tCount && tLength < (int) aSize; i++) {
+        tLength += snprintf(aText + tLength, aSize - tLength, "%c%u", i == 0 ? '-' : '.', tPorts[i]);
+    }
+}
+
+static int LIBUSB_CALL hotplugCallback(libusb_context *aContext, libusb_device *aDevice, libusb_hotplug_event aEvent,
+        void *aUserData) {
+    (void) aContext;
+    (void) aEvent;
+    (void) aUserData;
+    if (sArrivalCount < WORKERS_MAX) {
+        getPortPath(aDevice, sArrivals[sArrivalCount++], PORT_PATH_LENGTH);
+    }
+    return 0;
+}
+
+static void stopHandler(int aSignal) {
+    (void) aSignal;
+    sStop = 1;
+}
+
+static worker_t* findWorker(const char *aPortPath) {
+    for (uint8_t i = 0; i < WORKERS_MAX; i++) {
+        if (sWorkers[i].pid && strcmp(sWorkers[i].portPath, aPortPath) == 0) {
+            return &sWorkers[i];
+        }
+    }
+    return NULL;
+}
+
+static int startWorker(const char *aPortPath, char *const aArguments[], uint8_t aActive) {
+    worker_t *tWorker = NULL;
+    for (uint8_t i = 0; !tWorker && i < WORKERS_MAX; i++) {
+        if (!sWorkers[i].pid) {
+            tWorker = &sWorkers[i];
+        }
+    }
+    int tOutput[2], tErrors[2];
+    if (!tWorker || pipe(tOutput) < 0 || pipe(tErrors) < 0) {
+        fprintf(stderr, "Can not start worker for port %s\n", aPortPath);
+        return -1;
+    }
+    free(tWorker->report);
+    memset(tWorker, 0, sizeof(worker_t));
+    snprintf(tWorker->portPath, sizeof(tWorker->portPath), "%s", aPortPath);
+    tWorker->startMillis = nowMillis();
+    tWorker->active = aActive;
+    tWorker->pid = fork();
+    if (tWorker->pid == 0) {
+        dup2(tOutput[1], STDOUT_FILENO);
+        dup2(tErrors[1], STDERR_FILENO);
+        close(tOutput[0]);
+        close(tErrors[0]);
+        execvp(aArguments[0], aArguments);
+        fprintf(stderr, "%s: %s\n", aArguments[0], strerror(errno));
+        _exit(127);
+    }
+    close(tOutput[1]);
+    close(tErrors[1]);
+    if (tWorker->pid < 0) {
+        tWorker->pid = 0;
+        close(tOutput[0]);
+        close(tErrors[0]);
+        return -1;
+    }
+    tWorker->output = tOutput[0];
+    tWorker->errors = tErrors[0];
+    fcntl(tWorker->output, F_SETFL, O_NONBLOCK);
+    fcntl(tWorker->errors, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * Reads what is available from the pipes of the worker, the report is kept completely, of the errors only the last line
+ */
+static void readWorker(worker_t *aWorker) {
+    char tBuffer[4096];
+    ssize_t tLength;
+    while ((tLength = read(aWorker->output, tBuffer, sizeof(tBuffer))) > 0) {
+        aWorker->report = realloc(aWorker->report, aWorker->reportLength + tLength + 1);
+        if (!aWorker->report) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        memcpy(aWorker->report + aWorker->reportLength, tBuffer, tLength);
+        aWorker->reportLength += tLength;
+        aWorker->report[aWorker->reportLength] = '\0';
+    }
+    while ((tLength = read(aWorker->errors, tBuffer, sizeof(tBuffer))) > 0) {
+        for (ssize_t i = 0; i < tLength; i++) {
+            if (tBuffer[i] == '\n' || tBuffer[i] == '\r') {
+                if (aWorker->errorLength) {
+                    aWorker->error[aWorker->errorLength] = '\0';
+                    aWorker->errorLength = 0;
+                }
+            } else if (aWorker->errorLength < ERROR_LENGTH - 1) {
+                aWorker->error[aWorker->errorLength++] = (tBuffer[i] == '"') ? '\'' : tBuffer[i];
+            }
+        }
+    }
+}
+
+static void writeReport(const worker_t *aWorker, const char *aDirectory, uint16_t aNumber) {
+    char tFileName[256];
+    snprintf(tFileName, sizeof(tFileName), "%s/%s-%u.txt", aDirectory, aWorker->portPath, aNumber);
+    FILE *tFile = fopen(tFileName, "w");
+    if (!tFile) {
+        perror(tFileName);
+        return;
+    }
+    if (aWorker->report) {
+        fputs(aWorker->report, tFile);
+    }
+    fclose(tFile);
+}
+
+/*
+ * Terminates the waiting workers of the station mode, before they get a board which would not be counted
+ */
+static void stopWaitingWorkers(void) {
+    for (uint8_t i = 0; i < WORKERS_MAX; i++) {
+        if (sWorkers[i].pid && !sWorkers[i].active) {
+            kill(sWorkers[i].pid, SIGTERM);
+            waitpid(sWorkers[i].pid, NULL, 0);
+            close(sWorkers[i].output);
+            close(sWorkers[i].errors);
+            sWorkers[i].pid = 0;
+        }
+    }
+}
+
+/*
+ * Prints the result line of a finished worker, returns 1 if the device passed
+ */
+static int reportWorker(worker_t *aWorker, int aStatus) {
+    double tMillis = nowMillis() - aWorker->startMillis;
+    const char *tTotal = aWorker->report ? strstr(aWorker->report, "total ") : NULL;
+    const char *tSerial = aWorker->report ? strstr(aWorker->report, " serial=") : NULL;
+    char tSerialNumber[33] = "-";
+    if (tSerial) {
+        sscanf(tSerial, " serial=%32s", tSerialNumber);
+    }
+    double tTotalMillis, tBytesPerSecond;
+    unsigned tBytes, tRetries;
+    if (WIFEXITED(aStatus) && WEXITSTATUS(aStatus) == 0 && tTotal
+            && sscanf(tTotal, "total ms=%lf bytes=%u bytes_per_s=%lf retries=%u", &tTotalMillis, &tBytes,
+                    &tBytesPerSecond, &tRetries) == 4) {
+        const char *tResult = strstr(aWorker->report, " identical=1") ? "skip" : "pass";
+        printf("device port=%s serial=%s result=%s ms=%.1f bytes_per_s=%.0f retries=%u\n", aWorker->portPath,
+                tSerialNumber, tResult, tTotalMillis, tBytesPerSecond, tRetries);
+        return 1;
+    }
+    if (WIFSIGNALED(aStatus)) {
+        snprintf(aWorker->error, sizeof(aWorker->error), "terminated by signal %d", WTERMSIG(aStatus));
+    }
+    aWorker->error[aWorker->errorLength ? aWorker->errorLength : sizeof(aWorker->error) - 1] = '\0';
+    printf("device port=%s serial=%s result=fail ms=%.1f error=\"%s\"\n", aWorker->portPath, tSerialNumber, tMillis,
+            aWorker->error[0] ? aWorker->error : "unknown");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int tOption;
+    unsigned tDevicesToFlash = 0;
+    double tIdleSeconds = 0;
+    const char *tUploadPath = NULL;
+    const char *tReportDirectory = NULL;
+    const char *tDepth = NULL;
+    const char *tBootloader = NULL;
+    const char *tCacheDirectory = NULL;
+    uint8_t tStation = 0;
+    while ((tOption = getopt(argc, argv, "n:t:su:o:d:b:c:")) != -1) {
+        switch (tOption) {
+        case 'n':
+            tDevicesToFlash = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            tIdleSeconds = atof(optarg);
+            break;
+        case 's':
+            tStation = 1;
+            break;
+        case 'u':
+            tUploadPath = optarg;
+            break;
+        case 'o':
+            tReportDirectory = optarg;
+            break;
+        case 'd':
+            tDepth = optarg;
+            break;
+        case 'b':
+            tBootloader = optarg;
+            break;
+        case 'c':
+            tCacheDirectory = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-n devices] [-t idle_seconds] [-s] [-u mnupload] [-o report_dir] [-d depth] [-b bootloader.hex] "
+                "[-c cache_dir] file.hex\n", argv[0]);
+        return 2;
+    }
+    if (access(argv[optind], R_OK) < 0) {
+        perror(argv[optind]);
+        return 2;
+    }
+    if (tBootloader && access(tBootloader, R_OK) < 0) {
+        perror(tBootloader);
+        return 2;
+    }
+    char tDefaultPath[256];
+    if (!tUploadPath) {
+        const char *tSlash = strrchr(argv[0], '/');
+        snprintf(tDefaultPath, sizeof(tDefaultPath), "%.*smnupload", tSlash ? (int) (tSlash - argv[0] + 1) : 0,
+                argv[0]);
+        tUploadPath = tDefaultPath;
+    }
+    char tPortPath[PORT_PATH_LENGTH];
+    char *tArguments[16] = { (char *) tUploadPath, "-q", "-w", WORKER_WAIT_S, "-p", tPortPath };
+    uint8_t tArgumentCount = 6;
+    if (tDepth) {
+        tArguments[tArgumentCount++] = "-d";
+        tArguments[tArgumentCount++] = (char *) tDepth;
+    }
+    if (tBootloader) {
+        tArguments[tArgumentCount++] = "-b";
+        tArguments[tArgumentCount++] = (char *) tBootloader;
+    }
+    if (tCacheDirectory) {
+        tArguments[tArgumentCount++] = "-c";
+        tArguments[tArgumentCount++] = (char *) tCacheDirectory;
+    }
+    tArguments[tArgumentCount] = argv[optind];
+
+    libusb_context *tContext;
+    if (libusb_init(&tContext) < 0 || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "libusb with hotplug support is required\n");
+        return 2;
+    }
+    signal(SIGINT, stopHandler);
+    signal(SIGTERM, stopHandler);
+    libusb_hotplug_register_callback(tContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+            MICRONUCLEUS_VID, MICRONUCLEUS_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, NULL, NULL);
+    fprintf(stderr, "Waiting for devices, stop with Ctrl-C\n");
+
+    double tStart = nowMillis();
+    double tLastActivity = tStart;
+    unsigned tStarted = 0, tPassed = 0, tFailed = 0;
+    uint8_t tRunning = 0;
+    while (tRunning || !(sStop || (tDevicesToFlash && tStarted >= tDevicesToFlash)
+            || (tIdleSeconds > 0 && nowMillis() - tLastActivity > tIdleSeconds * 1000))) {
+        struct timeval tTimeout = { 0, POLL_MS * 1000 };
+        libusb_handle_events_timeout_completed(tContext, &tTimeout, NULL);
+
+        for (uint8_t i = 0; i < sArrivalCount; i++) {
+            if (sStop || (tDevicesToFlash && tStarted >= tDevicesToFlash)) {
+                continue;
+            }
+            worker_t *tWorker = findWorker(sArrivals[i]);
+            if (tWorker && tWorker->active) {
+                continue;
+            }
+            snprintf(tPortPath, sizeof(tPortPath), "%s", sArrivals[i]);
+            tArguments[3] = WORKER_WAIT_S;
+            if (tWorker) {
+                // The waiting worker has already got the device
+                tWorker->active = 1;
+                tWorker->startMillis = nowMillis();
+            } else if (startWorker(tPortPath, tArguments, 1) < 0) {
+                continue;
+            }
+            fprintf(stderr, "Flashing device at port %s\n", tPortPath);
+            tStarted++;
+            tRunning++;
+        }
+        sArrivalCount = 0;
+        if (sStop || (tDevicesToFlash && tStarted >= tDevicesToFlash)) {
+            stopWaitingWorkers();
+        }
+
+        for (uint8_t i = 0; i < WORKERS_MAX; i++) {
+            worker_t *tWorker = &sWorkers[i];
+            if (!tWorker->pid) {
+                continue;
+            }
+            readWorker(tWorker);
+            int tStatus;
+            if (waitpid(tWorker->pid, &tStatus, WNOHANG) != tWorker->pid) {
+                continue;
+            }
+            fcntl(tWorker->output, F_SETFL, 0);
+            fcntl(tWorker->errors, F_SETFL, 0);
+            readWorker(tWorker);
+            close(tWorker->output);
+            close(tWorker->errors);
+            tWorker->pid = 0;
+            if (!tWorker->active) {
+                tWorker->error[tWorker->errorLength ? tWorker->errorLength : sizeof(tWorker->error) - 1] = '\0';
+                fprintf(stderr, "Waiting worker at port %s ended: %s\n", tWorker->portPath, tWorker->error);
+                continue;
+            }
+            tRunning--;
+            int tPassedNow = reportWorker(tWorker, tStatus);
+            if (tPassedNow) {
+                tPassed++;
+            } else {
+                tFailed++;
+            }
+            if (tReportDirectory) {
+                writeReport(tWorker, tReportDirectory, tPassed + tFailed);
+            }
+            fflush(stdout);
+            // A failed board may still be there, it would be flashed by the waiting worker without being counted
+            if (tStation && tPassedNow && !sStop && !(tDevicesToFlash && tStarted >= tDevicesToFlash)) {
+                snprintf(tPortPath, sizeof(tPortPath), "%s", tWorker->portPath);
+                tArguments[3] = STATION_WAIT_S;
+                startWorker(tPortPath, tArguments, 0);
+            }
+        }
+        if (tRunning) {
+            tLastActivity = nowMillis();
+        }
+    }
+
+    stopWaitingWorkers();
+    double tMillis = nowMillis() - tStart;
+    printf("summary devices=%u passed=%u failed=%u ms=%.0f devices_per_min=%.1f\n", tPassed + tFailed, tPassed,
+            tFailed, tMillis, (tPassed + tFailed) * 60000.0 / tMillis);
+    libusb_exit(tContext);
+    return tFailed ? 1 : 0;
+}
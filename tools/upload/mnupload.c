@@ -0,0 +1,909 @@
+/* Name: mnupload.c
+ * Project: Micronucleus upload
+ *
+ * Uploads an Intel HEX file to a micronucleus V2 bootloader with the asynchronous API of libusb-1.0.
+ * Instead of the request-then-sleep cycle of the command line tool, all transfers of a page are queued
+ * at once, so the host controller sends them back to back without a round trip through user space.
+ * The host only sleeps where the device is halted: during the erase and after the last transfer of each page.
+ *
+ * A transfer of a page is not repeated alone, since the transfers behind it may already have been executed.
+ * A failed page is sent again completely, cmd_transfer_page resets the page buffer of the device.
+ * This is not possible for page 0, the device ignores cmd_transfer_page until page 0 is written,
+ * so a failure in page 0 repeats the erase and the upload.
+ *
+ * With feature bit 0 (ENABLE_FRAME_ALIGNED_SPM) the next page is sent 1 ms later, when the halt has surely ended.
+ * With feature bit 1 (ENABLE_INTERLEAVED_ERASE) the erase is polled with cmd_get_status instead of waiting for all pages.
+ *
+ * A machine readable timing report is printed to stdout, one line per phase with the name of the phase followed by key=value pairs:
+ *   connect ms=...                      from the start of the tool to the arrival of the device
+ *   enumeration ms=... version=... features=... serial=...   from the arrival, i.e. after the enumeration by the kernel,
+ *                                       to the device info, serial is - if the bootloader has no serial number (ENABLE_SERIAL_NUMBER)
+ *   bootloader ms=... crc=0x... expected=0x... configuration=0x... identical=...   only with -b, see below
+ *   plan ms=... pages=... blank=... cached=...   pages to send and blank pages left out, see planPages()
+ *   erase ms=... pages=... polls=...
+ *   page address=0x.... ms=... sleep_ms=... transfers=... retries=...   one line per written page
+ *   exit ms=...                         from the exit request to the disconnect of the device
+ *   update ms=... crc=0x...             only with -u instead of exit, from cmd_self_update to the disconnect of the device
+ *   total ms=... bytes=... bytes_per_s=... retries=...   from the arrival to the disconnect
+ * Progress and errors are printed to stderr.
+ *
+ * With -b and feature bit 5 (ENABLE_BOOTLOADER_HASH), the CRC-32 of the bootloader of the device is compared with the one
+ * of the given bootloader HEX file, e.g. firmware/releases/t85_default.hex. Both cover only the linked bootloader.
+ * If they are identical, nothing is uploaded and the bootloader is left, so an upgrade runs only where it changes something.
+ * The configuration identifier of the device is the POSIX cksum of its configuration name, a warning is printed
+ * if it does not match the name of the bootloader file.
+ *
+ * With -c the upload plan is cached per image and target, see writePlan(). The HEX file is then only parsed if the plan is not cached.
+ *
+ * With -u and feature bit 6 (ENABLE_SELF_UPDATE), the HEX file is a new bootloader, built with ENABLE_SELF_UPDATE for the same
+ * part and BOOTLOADER_ADDRESS, since its first erase unit must be identical to the running one. The files in firmware/releases
+ * are not built with it and are refused, see isSelfUpdateBuild().
+ * It is uploaded like a program to the staging area behind page 0, see stageBootloader(), and cmd_self_update makes
+ * the device copy it over its bootloader. This replaces upgrade.hex, but the program must be uploaded again afterwards.
+ * As with -b, nothing is uploaded if the bootloader is identical.
+ *
+ * Usage: mnupload [-w wait_seconds] [-d depth] [-p port_path] [-s serial_number] [-b bootloader.hex] [-c cache_dir] [-u] [-q] file.hex
+ *   -w  time to wait for the device, default 60 s, 0 is forever
+ *   -p  upload only to the device at this port, given as bus-port.port... like in /sys/bus/usb/devices, e.g. 1-2.4
+ *   -s  upload only to the device with this serial number
+ *   -b  upload only if the bootloader of the device differs from this one
+ *   -c  directory for the cached upload plans, e.g. ~/.cache/mnupload, ignored with -u
+ *   -u  file.hex is a bootloader, which replaces the bootloader of the device
+ *   -d  maximum number of transfers in flight, default 16, 1 behaves like the command line tool without sleeps
+ *   -q  print only the report and errors
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <libusb.h>
+
+#include "mnhexfile.h"
+
+#define MICRONUCLEUS_VID    0x16D0
+#define MICRONUCLEUS_PID    0x0753
+#define WAIT_DEFAULT_S      60
+#define DEPTH_DEFAULT       16
+#define DEPTH_MAX           64
+#define TRANSFER_TIMEOUT_MS 1000
+#define TRANSFER_RETRIES    5       // the command line tool repeats failed requests
+#define UPLOAD_RETRIES      3       // erase and upload again after a failure in page 0
+#define ERASE_POLL_MS       2.0
+#define EXIT_TIMEOUT_MS     1000
+#define DATA_MAX            8
+#define CANDIDATES_MAX      32
+#define SERIAL_NUMBER_LENGTH_MAX    32
+#define PLAN_PAGES_MAX      (0x10000 / 16)  // the ATtiny841 has 16 byte pages
+#define PLAN_MAGIC          0x4E4C504D      // "MPLN"
+
+// Protocol, see firmware/main.c
+#define CMD_DEVICE_INFO     0
+#define CMD_TRANSFER_PAGE   1
+#define CMD_ERASE_APP       2
+#define CMD_WRITE_DATA      3
+#define CMD_EXIT            4
+#define CMD_GET_STATUS      5
+#define CMD_GET_BOOTLOADER_HASH 8
+#define CMD_SELF_UPDATE     9
+#define DEVICE_INFO_LENGTH  6
+#define TINYVECTOR_RESET_OFFSET     4       // postscript with the user reset vector below the bootloader
+#define TINYVECTOR_OSCCAL_OFFSET    6       // OSCCAL slot below the postscript, only with OSCCAL_SAVE_CALIB
+#define BOOTLOADER_HASH_LENGTH  10
+#define FEATURE_FRAME_ALIGNED_SPM   0x01
+#define FEATURE_INTERLEAVED_ERASE   0x02
+#define FEATURE_BOOTLOADER_HASH     0x20
+#define FEATURE_SELF_UPDATE         0x40
+
+typedef struct {
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint8_t inLength;           // 0 for control out
+    uint8_t *inData;
+    int received;               // bytes received, negative libusb error if the transfer failed
+} request_t;
+
+typedef struct {
+    struct libusb_transfer *transfer;
+    request_t *request;
+    uint8_t busy;
+    uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + DATA_MAX];
+} slot_t;
+
+static uint8_t sImage[0x10000];
+static uint32_t sImageSize;
+static uint8_t sBootloader[0x10000];
+static uint32_t sBootloaderSize;
+static const char *sBootloaderFileName;
+static const char *sCacheDirectory;
+static uint16_t sPlan[PLAN_PAGES_MAX];   // addresses of the pages to send, in this order
+static uint16_t sPlanCount;
+static uint8_t sSelfUpdate;
+static uint8_t sQuiet;
+static const char *sPortPath;
+static const char *sSerialNumberWanted;
+static char sSerialNumber[SERIAL_NUMBER_LENGTH_MAX + 1];
+
+static libusb_context *sContext;
+static libusb_device *sCandidates[CANDIDATES_MAX];  // arrived devices, set by the hotplug callback
+static double sCandidateMillis[CANDIDATES_MAX];
+static uint8_t sCandidateCount;
+static libusb_device *sDevice;          // the candidate selected for the upload
+static libusb_device_handle *sHandle;
+static double sArrivalMillis;
+static double sLeftMillis;
+static uint8_t sLeft;
+
+static slot_t sSlots[DEPTH_MAX];
+static uint8_t sDepth;
+static uint8_t sInFlight;
+static uint8_t sFailed;
+
+static double nowMillis(void) {
+    struct timespec tTime;
+    clock_gettime(CLOCK_MONOTONIC, &tTime);
+    return tTime.tv_sec * 1000.0 + tTime.tv_nsec / 1e6;
+}
+
+static void progress(const char *aFormat, const char *aText) {
+    if (!sQuiet) {
+        fprintf(stderr, aFormat, aText);
+    }
+}
+
+/*
+ * Port path of the device as used by the kernel, e.g. 1-2.4 for port 4 of the hub at port 2 of bus 1
+ */
+static void getPortPath(libusb_device *aDevice, char *aText, size_t aSize) {
+    uint8_t tPorts[7];
+    int tCount = libusb_get_port_numbers(aDevice, tPorts, sizeof(tPorts));
+    int tLength = snprintf(aText, aSize, "%u", libusb_get_bus_number(aDevice));
+    for (int i = 0; i < tCount && tLength < (int) aSize; i++) {
+        tLength += snprintf(aText + tLength, aSize - tLength, "%c%u", i == 0 ? '-' : '.', tPorts[i]);
+    }
+}
+
+/*
+ * The kernel has read the serial number during the enumeration, reading it from sysfs saves 2 control transfers
+ * before the first cmd_device_info. Returns -1 if there is no sysfs, e.g. in a container without /sys.
+ */
+static int readSysfsSerialNumber(libusb_device *aDevice) {
+    char tFileName[64];
+    int tLength = snprintf(tFileName, sizeof(tFileName), "/sys/bus/usb/devices/");
+    getPortPath(aDevice, tFileName + tLength, sizeof(tFileName) - tLength);
+    strncat(tFileName, "/serial", sizeof(tFileName) - strlen(tFileName) - 1);
+    FILE *tFile = fopen(tFileName, "r");
+    if (!tFile) {
+        return -1;
+    }
+    int tResult = fgets(sSerialNumber, sizeof(sSerialNumber), tFile) ? 0 : -1;
+    fclose(tFile);
+    sSerialNumber[strcspn(sSerialNumber, "\r\n")] = '\0';
+    return tResult;
+}
+
+static int LIBUSB_CALL hotplugCallback(libusb_context *aContext, libusb_device *aDevice, libusb_hotplug_event aEvent,
+        void *aUserData) {
+    (void) aContext;
+    (void) aUserData;
+    if (aEvent == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && !sDevice && sCandidateCount < CANDIDATES_MAX) {
+        char tPortPath[32];
+        getPortPath(aDevice, tPortPath, sizeof(tPortPath));
+        if (sPortPath && strcmp(tPortPath, sPortPath) != 0) {
+            return 0;
+        }
+        sCandidateMillis[sCandidateCount] = nowMillis();
+        sCandidates[sCandidateCount++] = libusb_ref_device(aDevice);
+    } else if (aEvent == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && aDevice == sDevice && !sLeft) {
+        sLeftMillis = nowMillis();
+        sLeft = 1;
+    }
+    return 0;
+}
+
+/*
+ * Handles libusb events until the time is reached or the condition is true
+ */
+static void waitUntil(double aMillis, const uint8_t *aCondition) {
+    while (!(aCondition && *aCondition)) {
+        double tRemaining = aMillis - nowMillis();
+        if (tRemaining <= 0) {
+            return;
+        }
+        struct timeval tTimeout = { (time_t) (tRemaining / 1000), (long) (tRemaining * 1000) % 1000000 };
+        libusb_handle_events_timeout_completed(sContext, &tTimeout, NULL);
+    }
+}
+
+static void waitMillis(double aMillis) {
+    waitUntil(nowMillis() + aMillis, NULL);
+}
+
+/*
+ * Opens the device and reads its serial number. Returns 0 and keeps it open, if it is the wanted one.
+ */
+static int selectDevice(libusb_device *aDevice) {
+    struct libusb_device_descriptor tDescriptor;
+    libusb_get_device_descriptor(aDevice, &tDescriptor);
+    int tResult = libusb_open(aDevice, &sHandle);
+    if (tResult < 0) {
+        fprintf(stderr, "Open failed: %s\n", libusb_strerror(tResult));
+        sHandle = NULL;
+        return -1;
+    }
+    sSerialNumber[0] = '\0';
+    if (tDescriptor.iSerialNumber && readSysfsSerialNumber(aDevice) < 0) {
+        libusb_get_string_descriptor_ascii(sHandle, tDescriptor.iSerialNumber, (unsigned char *) sSerialNumber,
+                sizeof(sSerialNumber));
+    }
+    if (sSerialNumberWanted && strcmp(sSerialNumber, sSerialNumberWanted) != 0) {
+        libusb_close(sHandle);
+        sHandle = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void LIBUSB_CALL transferCallback(struct libusb_transfer *aTransfer) {
+    slot_t *tSlot = aTransfer->user_data;
+    request_t *tRequest = tSlot->request;
+    if (aTransfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        tRequest->received = (aTransfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+        sFailed = 1;
+    } else {
+        tRequest->received = aTransfer->actual_length;
+        if (tRequest->inLength) {
+            memcpy(tRequest->inData, libusb_control_transfer_get_data(aTransfer), aTransfer->actual_length);
+        }
+    }
+    tSlot->busy = 0;
+    sInFlight--;
+}
+
+static int submit(request_t *aRequest) {
+    slot_t *tSlot = sSlots;
+    while (tSlot->busy) {
+        tSlot++;
+    }
+    uint8_t tType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
+            | (aRequest->inLength ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT);
+    libusb_fill_control_setup(tSlot->buffer, tType, aRequest->request, aRequest->value, aRequest->index,
+            aRequest->inLength);
+    libusb_fill_control_transfer(tSlot->transfer, sHandle, tSlot->buffer, transferCallback, tSlot,
+            TRANSFER_TIMEOUT_MS);
+    tSlot->request = aRequest;
+    int tResult = libusb_submit_transfer(tSlot->transfer);
+    if (tResult < 0) {
+        aRequest->received = tResult;
+        return tResult;
+    }
+    tSlot->busy = 1;
+    sInFlight++;
+    return 0;
+}
+
+/*
+ * Sends the requests in order with up to sDepth transfers in flight.
+ * After a failure no more requests are submitted and the transfers in flight are cancelled.
+ * Returns 0 if all requests completed.
+ */
+static int runRequests(request_t *aRequests, uint16_t aCount) {
+    uint16_t tNext = 0;
+    sFailed = 0;
+    while (tNext < aCount || sInFlight) {
+        while (!sFailed && tNext < aCount && sInFlight < sDepth) {
+            if (submit(&aRequests[tNext++]) < 0) {
+                sFailed = 1;
+            }
+        }
+        if (sFailed) {
+            for (uint8_t i = 0; i < sDepth; i++) {
+                if (sSlots[i].busy) {
+                    libusb_cancel_transfer(sSlots[i].transfer);
+                }
+            }
+            tNext = aCount;
+        }
+        if (sInFlight) {
+            libusb_handle_events_completed(sContext, NULL);
+        }
+    }
+    return sFailed ? -1 : 0;
+}
+
+static int controlOut(uint8_t aRequest, uint16_t aValue, uint16_t aIndex) {
+    request_t tRequest = { aRequest, aValue, aIndex, 0, NULL, 0 };
+    for (int i = 0; i < TRANSFER_RETRIES; i++) {
+        if (runRequests(&tRequest, 1) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int controlIn(uint8_t aRequest, uint8_t *aData, uint8_t aLength) {
+    request_t tRequest = { aRequest, 0, 0, aLength, aData, 0 };
+    runRequests(&tRequest, 1);
+    return tRequest.received;
+}
+
+/*
+ * CRC-32 as used by zlib, see initBootloaderHash() in firmware/main.c
+ */
+static uint32_t crc32Update(uint32_t aCrc, const uint8_t *aData, uint32_t aLength) {
+    for (uint32_t i = 0; i < aLength; i++) {
+        aCrc ^= aData[i];
+        for (uint8_t j = 0; j < 8; j++) {
+            aCrc = (aCrc & 1) ? (aCrc >> 1) ^ 0xEDB88320 : aCrc >> 1;
+        }
+    }
+    return aCrc;
+}
+
+static uint32_t crc32(const uint8_t *aData, uint32_t aLength) {
+    return ~crc32Update(0xFFFFFFFF, aData, aLength);
+}
+
+static int pageHasData(uint32_t aAddress, uint16_t aPageSize) {
+    for (uint32_t i = aAddress; i < aAddress + aPageSize && i < sImageSize; i++) {
+        if (sImage[i] != 0xFF) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds the list of the pages to send. Page 0 is sent first, since the device ignores cmd_transfer_page until
+ * page 0 is written, the others follow in ascending order. Pages which are blank (0xFF) after the reset vector
+ * patching are left out, the erase has already cleared them. The page with the postscript is never blank.
+ * With OSCCAL_SAVE_CALIB the device reports a program size 6 instead of 4 bytes below the bootloader and writes its
+ * calibration value into the slot below the postscript itself, so the slot is set blank here.
+ */
+static void planPages(uint16_t aPageSize, uint16_t aBootloaderAddress, uint16_t aProgramSize) {
+    if (aBootloaderAddress - aProgramSize >= TINYVECTOR_OSCCAL_OFFSET) {
+        sImage[aBootloaderAddress - TINYVECTOR_OSCCAL_OFFSET] = 0xFF;
+        sImage[aBootloaderAddress - TINYVECTOR_OSCCAL_OFFSET + 1] = 0xFF;
+    }
+    sPlanCount = 0;
+    for (uint32_t tAddress = 0; tAddress < aBootloaderAddress; tAddress += aPageSize) {
+        if (tAddress == 0 || pageHasData(tAddress, aPageSize)) {
+            sPlan[sPlanCount++] = tAddress;
+        }
+    }
+}
+
+/*
+ * The cached plan contains a header with the target and the size of the image, the page addresses and the content
+ * of these pages. The file name is built from the path, size and CRC-32 of the content of the HEX file and the target,
+ * so a changed image or another part gets a new plan. The modification time is not used, since a file rewritten within
+ * the same second, or copied with its old time stamp, would keep the stale plan.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t imageBytes;
+    uint16_t pageSize;
+    uint16_t bootloaderAddress;
+    uint16_t programSize;
+    uint16_t pageCount;
+} plan_header_t;
+
+static int getPlanFileName(const char *aImageFileName, plan_header_t *aHeader, char *aFileName, size_t aSize) {
+    char tPath[PATH_MAX];
+    FILE *tFile;
+    if (!realpath(aImageFileName, tPath) || !(tFile = fopen(tPath, "rb"))) {
+        perror(aImageFileName);
+        return -1;
+    }
+    uint8_t tBuffer[4096];
+    uint32_t tCrc = 0xFFFFFFFF;
+    unsigned long tFileSize = 0;
+    size_t tLength;
+    while ((tLength = fread(tBuffer, 1, sizeof(tBuffer), tFile)) > 0) {
+        tCrc = crc32Update(tCrc, tBuffer, tLength);
+        tFileSize += tLength;
+    }
+    int tError = ferror(tFile);
+    fclose(tFile);
+    if (tError) {
+        fprintf(stderr, "%s: read error\n", aImageFileName);
+        return -1;
+    }
+    snprintf(aFileName, aSize, "%s/plan-%08X-%lX-%08X-%04X-%04X-%04X", sCacheDirectory,
+            crc32((const uint8_t *) tPath, strlen(tPath)), tFileSize, ~tCrc, aHeader->pageSize,
+            aHeader->bootloaderAddress, aHeader->programSize);
+    return 0;
+}
+
+/*
+ * Returns 0 and sets sPlan and the planned pages of sImage, if a plan for this target is cached
+ */
+static int readPlan(const char *aFileName, plan_header_t *aHeader) {
+    FILE *tFile = fopen(aFileName, "rb");
+    if (!tFile) {
+        return -1;
+    }
+    plan_header_t tHeader;
+    int tResult = -1;
+    if (fread(&tHeader, sizeof(tHeader), 1, tFile) == 1 && tHeader.magic == PLAN_MAGIC
+            && tHeader.pageSize == aHeader->pageSize && tHeader.bootloaderAddress == aHeader->bootloaderAddress
+            && tHeader.programSize == aHeader->programSize && tHeader.pageCount <= PLAN_PAGES_MAX
+            && fread(sPlan, sizeof(sPlan[0]), tHeader.pageCount, tFile) == tHeader.pageCount) {
+        tResult = 0;
+        for (uint16_t i = 0; i < tHeader.pageCount && tResult == 0; i++) {
+            if (sPlan[i] + tHeader.pageSize > sizeof(sImage) || fread(sImage + sPlan[i], tHeader.pageSize, 1, tFile) != 1) {
+                tResult = -1;
+            }
+        }
+    }
+    fclose(tFile);
+    if (tResult == 0) {
+        sPlanCount = tHeader.pageCount;
+        aHeader->imageBytes = tHeader.imageBytes;
+    }
+    return tResult;
+}
+
+/*
+ * Written to a temporary file first, since the workers of mnflash may write the same plan at the same time
+ */
+static void writePlan(const char *aFileName, plan_header_t *aHeader) {
+    char tTemporary[PATH_MAX + 16];
+    snprintf(tTemporary, sizeof(tTemporary), "%s.%d", aFileName, (int) getpid());
+    FILE *tFile = fopen(tTemporary, "wb");
+    if (!tFile) {
+        perror(tTemporary);
+        return;
+    }
+    aHeader->magic = PLAN_MAGIC;
+    aHeader->pageCount = sPlanCount;
+    int tResult = fwrite(aHeader, sizeof(*aHeader), 1, tFile) == 1
+            && fwrite(sPlan, sizeof(sPlan[0]), sPlanCount, tFile) == sPlanCount;
+    for (uint16_t i = 0; i < sPlanCount && tResult; i++) {
+        tResult = fwrite(sImage + sPlan[i], aHeader->pageSize, 1, tFile) == 1;
+    }
+    if (fclose(tFile) != 0 || !tResult || rename(tTemporary, aFileName) < 0) {
+        perror(tTemporary);
+        unlink(tTemporary);
+    }
+}
+
+/*
+ * Moves the user reset vector to the postscript and lets page 0 jump to the bootloader, as the command line tool does.
+ * Devices with more than 8 kByte flash use jmp instead of rjmp.
+ */
+static void patchResetVector(uint16_t aBootloaderAddress) {
+    uint16_t tUserReset = sImage[0] | (sImage[1] << 8);
+    uint32_t tUserResetTarget;
+    if (tUserReset == 0x940C) {
+        tUserResetTarget = (sImage[2] | (sImage[3] << 8)) * 2;
+    } else {
+        tUserResetTarget = ((tUserReset & 0x0FFF) + 1) * 2;
+    }
+    uint16_t tPostscript = aBootloaderAddress - 4;
+    uint16_t tJump[2];
+    if (aBootloaderAddress >= 8192) {
+        tJump[0] = 0x940C;
+        tJump[1] = aBootloaderAddress / 2;
+        sImage[0] = tJump[0] & 0xFF;
+        sImage[1] = tJump[0] >> 8;
+        sImage[2] = tJump[1] & 0xFF;
+        sImage[3] = tJump[1] >> 8;
+        tJump[1] = tUserResetTarget / 2;
+    } else {
+        tJump[0] = 0xC000 | ((aBootloaderAddress / 2 - 1) & 0x0FFF);
+        sImage[0] = tJump[0] & 0xFF;
+        sImage[1] = tJump[0] >> 8;
+        tJump[0] = 0xC000 | (((tUserResetTarget - tPostscript - 2) / 2) & 0x0FFF);
+        tJump[1] = 0xFFFF;
+    }
+    sImage[tPostscript] = tJump[0] & 0xFF;
+    sImage[tPostscript + 1] = tJump[0] >> 8;
+    sImage[tPostscript + 2] = tJump[1] & 0xFF;
+    sImage[tPostscript + 3] = tJump[1] >> 8;
+    if (sImageSize < tPostscript + 4U) {
+        sImageSize = tPostscript + 4;
+    }
+}
+
+/*
+ * With -u the image is the bootloader from BOOTLOADER_ADDRESS to the end of the flash, staged at the second page,
+ * see selfUpdate() in firmware/main.c. Page 0 jumps to the bootloader and the postscript stays blank,
+ * so the new bootloader finds no program. The flash size is the next power of two above the bootloader address.
+ * Returns the number of staged bytes or 0 if the bootloader file does not fit the device.
+ */
+static uint16_t stageBootloader(uint16_t aPageSize, uint16_t aBootloaderAddress) {
+    uint32_t tFlashSize = aPageSize;
+    while (tFlashSize <= aBootloaderAddress) {
+        tFlashSize <<= 1;
+    }
+    uint32_t tLength = tFlashSize - aBootloaderAddress;
+    if (sBootloaderSize <= aBootloaderAddress || sBootloaderSize > tFlashSize
+            || aPageSize + tLength > (uint32_t) aBootloaderAddress - aPageSize) {
+        return 0;
+    }
+    memset(sImage, 0xFF, sizeof(sImage));
+    if (aBootloaderAddress >= 8192) {
+        sImage[0] = 0x0C; // jmp
+        sImage[1] = 0x94;
+        sImage[2] = (aBootloaderAddress / 2) & 0xFF;
+        sImage[3] = (aBootloaderAddress / 2) >> 8;
+    } else {
+        uint16_t tJump = 0xC000 | ((aBootloaderAddress / 2 - 1) & 0x0FFF);
+        sImage[0] = tJump & 0xFF;
+        sImage[1] = tJump >> 8;
+    }
+    memcpy(&sImage[aPageSize], &sBootloader[aBootloaderAddress], tLength);
+    sImageSize = aPageSize + tLength;
+    return tLength;
+}
+
+/*
+ * Size of the first erase unit of the bootloader, which cmd_self_update does not copy, see SELF_UPDATE_FIXED_SIZE
+ * in firmware/main.c. The ATtiny441/841/1634 erase 4 pages at once, they are recognized by the signature in the device info.
+ */
+static uint16_t getEraseUnitSize(const uint8_t *aInfo, uint16_t aPageSize) {
+    if ((aInfo[5] == 0x15 && (aInfo[4] == 0x92 || aInfo[4] == 0x93)) || (aInfo[4] == 0x94 && aInfo[5] == 0x12)) {
+        return aPageSize * 4;
+    }
+    return aPageSize;
+}
+
+/*
+ * Returns 1 if the reset vector of the bootloader file jumps behind its first erase unit. crt1.S of an ENABLE_SELF_UPDATE
+ * build pads the vector and the copy routine to the erase unit, other builds have __init directly behind the vector.
+ */
+static int isSelfUpdateBuild(uint16_t aBootloaderAddress, uint16_t aEraseUnitSize) {
+    const uint8_t *tVector = &sBootloader[aBootloaderAddress];
+    uint16_t tWord = tVector[0] | (tVector[1] << 8);
+    int32_t tTarget;
+    if ((tWord & 0xF000) == 0xC000) { // rjmp
+        tTarget = aBootloaderAddress + 2 + 2 * (((tWord & 0x0FFF) ^ 0x0800) - 0x0800);
+    } else if ((tWord & 0xFE0E) == 0x940C) { // jmp
+        tTarget = 2 * (tVector[2] | (tVector[3] << 8));
+    } else {
+        return 0;
+    }
+    return tTarget >= aBootloaderAddress + aEraseUnitSize;
+}
+
+/*
+ * CRC of the POSIX cksum command, which the firmware Makefile uses for the configuration identifier
+ */
+static uint32_t cksum(const char *aText, size_t aLength) {
+    uint32_t tCrc = 0;
+    for (size_t i = 0; i < aLength + sizeof(size_t); i++) {
+        uint8_t tByte;
+        if (i < aLength) {
+            tByte = aText[i];
+        } else if ((i - aLength) && !(aLength >> (8 * (i - aLength)))) {
+            break; // the length is appended with as few bytes as possible
+        } else {
+            tByte = aLength >> (8 * (i - aLength));
+        }
+        tCrc ^= (uint32_t) tByte << 24;
+        for (uint8_t j = 0; j < 8; j++) {
+            tCrc = (tCrc & 0x80000000) ? (tCrc << 1) ^ 0x04C11DB7 : tCrc << 1;
+        }
+    }
+    return ~tCrc;
+}
+
+/*
+ * Returns 1 if the bootloader of the device is identical to the one of sBootloaderFileName, 0 if not or if this is unknown
+ */
+static int isBootloaderIdentical(uint8_t aFeatures, uint16_t aBootloaderAddress) {
+    if (!(aFeatures & FEATURE_BOOTLOADER_HASH)) {
+        progress("The bootloader has no hash (ENABLE_BOOTLOADER_HASH), uploading %s\n", "anyway");
+        return 0;
+    }
+    double tStart = nowMillis();
+    uint8_t tHash[BOOTLOADER_HASH_LENGTH];
+    int tHashLength = -1;
+    for (int i = 0; i < TRANSFER_RETRIES && tHashLength < BOOTLOADER_HASH_LENGTH; i++) {
+        tHashLength = controlIn(CMD_GET_BOOTLOADER_HASH, tHash, sizeof(tHash));
+    }
+    if (tHashLength < BOOTLOADER_HASH_LENGTH) {
+        fprintf(stderr, "No bootloader hash received, uploading anyway\n");
+        return 0;
+    }
+    uint32_t tCrc = tHash[0] | (tHash[1] << 8) | (tHash[2] << 16) | ((uint32_t) tHash[3] << 24);
+    uint32_t tConfigurationId = tHash[4] | (tHash[5] << 8) | (tHash[6] << 16) | ((uint32_t) tHash[7] << 24);
+    uint16_t tLength = tHash[8] | (tHash[9] << 8);
+    if ((uint32_t) aBootloaderAddress + tLength > sizeof(sBootloader)) {
+        tLength = 0;
+    }
+    uint32_t tExpected = crc32(sBootloader + aBootloaderAddress, tLength);
+    // The device hashes only its linked bootloader, which must end where the bootloader file ends
+    int tIdentical = tCrc == tExpected && sBootloaderSize == (uint32_t) aBootloaderAddress + tLength;
+    printf("bootloader ms=%.1f crc=0x%08X expected=0x%08X configuration=0x%08X identical=%d\n", nowMillis() - tStart, tCrc,
+            tExpected, tConfigurationId, tIdentical);
+
+    // The configuration name is the file name without directory and extension, as for the files in firmware/releases
+    const char *tName = strrchr(sBootloaderFileName, '/') ? strrchr(sBootloaderFileName, '/') + 1 : sBootloaderFileName;
+    const char *tExtension = strrchr(tName, '.');
+    size_t tNameLength = tExtension ? (size_t) (tExtension - tName) : strlen(tName);
+    if (tConfigurationId && tConfigurationId != cksum(tName, tNameLength)) {
+        fprintf(stderr, "The configuration of the device is not %.*s\n", (int) tNameLength, tName);
+    }
+    return tIdentical;
+}
+
+int main(int argc, char *argv[]) {
+    int tOption;
+    double tWaitSeconds = WAIT_DEFAULT_S;
+    int tDepth = DEPTH_DEFAULT;
+    while ((tOption = getopt(argc, argv, "w:d:p:s:b:c:uq")) != -1) {
+        switch (tOption) {
+        case 'w':
+            tWaitSeconds = atof(optarg);
+            break;
+        case 'd':
+            tDepth = atoi(optarg);
+            break;
+        case 'p':
+            sPortPath = optarg;
+            break;
+        case 's':
+            sSerialNumberWanted = optarg;
+            break;
+        case 'b':
+            sBootloaderFileName = optarg;
+            break;
+        case 'c':
+            sCacheDirectory = optarg;
+            break;
+        case 'u':
+            sSelfUpdate = 1;
+            break;
+        case 'q':
+            sQuiet = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc || tDepth < 1 || tDepth > DEPTH_MAX) {
+        fprintf(stderr, "Usage: %s [-w wait_seconds] [-d depth (1 to %u)] [-p port_path] [-s serial_number] [-b bootloader.hex] [-c cache_dir] [-u] [-q] "
+                "file.hex\n",
+                argv[0], DEPTH_MAX);
+        return 2;
+    }
+    sDepth = tDepth;
+    if (sSelfUpdate) {
+        sBootloaderFileName = argv[optind]; // the image is built from it by stageBootloader()
+        sCacheDirectory = NULL;
+    }
+    memset(sImage, 0xFF, sizeof(sImage));
+    memset(sBootloader, 0xFF, sizeof(sBootloader));
+    if (sCacheDirectory && access(argv[optind], R_OK) < 0) {
+        perror(argv[optind]);
+        return 2;
+    }
+    if ((!sCacheDirectory && !sSelfUpdate && mnhex_read(argv[optind], sImage, sizeof(sImage), &sImageSize) < 0)
+            || (sBootloaderFileName && mnhex_read(sBootloaderFileName, sBootloader, sizeof(sBootloader), &sBootloaderSize) < 0)) {
+        return 2;
+    }
+
+    if (libusb_init(&sContext) < 0 || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "libusb with hotplug support is required\n");
+        return 2;
+    }
+    for (uint8_t i = 0; i < DEPTH_MAX; i++) {
+        sSlots[i].transfer = libusb_alloc_transfer(0);
+    }
+    double tStart = nowMillis();
+    libusb_hotplug_register_callback(sContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, MICRONUCLEUS_VID, MICRONUCLEUS_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback,
+            NULL, NULL);
+    progress("Please plug in the device%s\n", tWaitSeconds > 0 ? "" : ", waiting forever");
+    while (!sDevice && (tWaitSeconds <= 0 || nowMillis() - tStart < tWaitSeconds * 1000)) {
+        waitUntil(nowMillis() + 100, &sCandidateCount);
+        for (uint8_t i = 0; i < sCandidateCount; i++) {
+            if (!sDevice && selectDevice(sCandidates[i]) == 0) {
+                sDevice = sCandidates[i];
+                sArrivalMillis = sCandidateMillis[i];
+            } else {
+                libusb_unref_device(sCandidates[i]);
+            }
+        }
+        sCandidateCount = 0;
+    }
+    if (!sDevice) {
+        fprintf(stderr, "No device found\n");
+        return 1;
+    }
+    printf("connect ms=%.1f\n", sArrivalMillis - tStart);
+
+    struct libusb_device_descriptor tDescriptor;
+    libusb_get_device_descriptor(sDevice, &tDescriptor);
+    if ((tDescriptor.bcdDevice >> 8) < 2) {
+        fprintf(stderr, "Bootloader version %u.%u is not supported, at least 2.0 is required\n", tDescriptor.bcdDevice >> 8,
+                tDescriptor.bcdDevice & 0xFF);
+        return 1;
+    }
+    uint8_t tInfo[DEVICE_INFO_LENGTH + 1];
+    int tInfoLength = -1;
+    for (int i = 0; i < TRANSFER_RETRIES && tInfoLength < DEVICE_INFO_LENGTH; i++) {
+        tInfoLength = controlIn(CMD_DEVICE_INFO, tInfo, sizeof(tInfo));
+    }
+    if (tInfoLength < DEVICE_INFO_LENGTH) {
+        fprintf(stderr, "No device info received\n");
+        return 1;
+    }
+    uint16_t tProgramSize = (tInfo[0] << 8) | tInfo[1];
+    uint16_t tPageSize = tInfo[2] ? tInfo[2] : 256;
+    uint8_t tWriteSleep = tInfo[3] & 0x7F;
+    uint8_t tEraseSleep = (tInfo[3] & 0x80) ? tWriteSleep / 4 : tWriteSleep;
+    uint16_t tBootloaderAddress = (tProgramSize + tPageSize - 1) & ~(tPageSize - 1);
+    uint8_t tFeatures = (tInfoLength > DEVICE_INFO_LENGTH) ? tInfo[DEVICE_INFO_LENGTH] : 0;
+    printf("enumeration ms=%.1f version=%u.%u features=0x%02X serial=%s\n", nowMillis() - sArrivalMillis,
+            tDescriptor.bcdDevice >> 8, tDescriptor.bcdDevice & 0xFF, tFeatures, sSerialNumber[0] ? sSerialNumber : "-");
+    if (sSelfUpdate && !(tFeatures & FEATURE_SELF_UPDATE)) {
+        fprintf(stderr, "The bootloader has no self update (ENABLE_SELF_UPDATE), use upgrade.hex instead\n");
+        return 1;
+    }
+    uint32_t tImageBytes = 0;
+    // 1 transfer page and 1 write data per 4 bytes
+    static request_t sRequests[1 + 256 / 4];
+    uint16_t tPages = tBootloaderAddress / tPageSize;
+    uint16_t tRetries = 0;
+    uint16_t tPagesWritten = 0;
+    uint8_t tUploads = 0;
+    uint16_t tStagedLength = 0;
+    int tPageFailed;
+    if (sBootloaderFileName && isBootloaderIdentical(tFeatures, tBootloaderAddress)) {
+        tImageBytes = 0;
+        progress("The bootloader is identical, nothing to %s\n", "upload");
+    } else {
+        double tPlanStart = nowMillis();
+        plan_header_t tPlan = { 0, 0, tPageSize, tBootloaderAddress, tProgramSize, 0 };
+        char tPlanFileName[PATH_MAX];
+        uint8_t tCached = 0;
+        if (sCacheDirectory) {
+            if (getPlanFileName(argv[optind], &tPlan, tPlanFileName, sizeof(tPlanFileName)) < 0) {
+                return 2;
+            }
+            tCached = readPlan(tPlanFileName, &tPlan) == 0;
+            if (!tCached && mnhex_read(argv[optind], sImage, sizeof(sImage), &sImageSize) < 0) {
+                return 2;
+            }
+        }
+        if (!tCached) {
+            if (sSelfUpdate && (tStagedLength = stageBootloader(tPageSize, tBootloaderAddress)) == 0) {
+                fprintf(stderr, "Bootloader %s does not fit a device with bootloader at 0x%04X\n", sBootloaderFileName,
+                        tBootloaderAddress);
+                return 1;
+            }
+            if (sSelfUpdate && !isSelfUpdateBuild(tBootloaderAddress, getEraseUnitSize(tInfo, tPageSize))) {
+                fprintf(stderr, "Bootloader %s is not built with ENABLE_SELF_UPDATE, the device would reject it\n",
+                        sBootloaderFileName);
+                return 1;
+            }
+            if (sImageSize > tProgramSize) {
+                fprintf(stderr, "Image of %u bytes does not fit into %u bytes\n", sImageSize, tProgramSize);
+                return 1;
+            }
+            tPlan.imageBytes = sImageSize;
+            if (!sSelfUpdate) {
+                patchResetVector(tBootloaderAddress);
+            }
+            planPages(tPageSize, tBootloaderAddress, tProgramSize);
+            if (sCacheDirectory) {
+                writePlan(tPlanFileName, &tPlan);
+            }
+        }
+        tImageBytes = tPlan.imageBytes;
+        printf("plan ms=%.1f pages=%u blank=%u cached=%u\n", nowMillis() - tPlanStart, sPlanCount, tPages - sPlanCount,
+                tCached);
+        do {
+            progress("Erasing%s\n", "");
+            double tEraseStart = nowMillis();
+            uint16_t tPolls = 0;
+            if (controlOut(CMD_ERASE_APP, 0, 0) < 0) {
+                fprintf(stderr, "Erase request failed\n");
+                return 1;
+            }
+            if (tFeatures & FEATURE_INTERLEAVED_ERASE) {
+                // Poll until all pages are erased. The device erases only if it was idle for a frame, so wait between the polls.
+                uint8_t tRemaining = 0xFF;
+                while (tRemaining) {
+                    tPolls++;
+                    if (controlIn(CMD_GET_STATUS, &tRemaining, 1) < 1) {
+                        tRemaining = 0xFF; // poll was lost during a page erase
+                        waitMillis(ERASE_POLL_MS);
+                    } else if (tRemaining) {
+                        waitMillis(tRemaining > 1 ? (tRemaining - 1) * tEraseSleep : ERASE_POLL_MS);
+                    }
+                }
+            } else {
+                waitMillis(tEraseSleep * tPages);
+            }
+            printf("erase ms=%.1f pages=%u polls=%u\n", nowMillis() - tEraseStart, tPages, tPolls);
+
+            tPageFailed = 0;
+            tPagesWritten = 0;
+            for (uint16_t tPage = 0; tPage < sPlanCount && !tPageFailed; tPage++) {
+                uint32_t tAddress = sPlan[tPage];
+                uint16_t tCount = 0;
+                sRequests[tCount++] = (request_t ) { CMD_TRANSFER_PAGE, tPageSize, tAddress, 0, NULL, 0 };
+                for (uint32_t i = tAddress; i < tAddress + tPageSize; i += 4) {
+                    sRequests[tCount++] = (request_t ) { CMD_WRITE_DATA, sImage[i] | (sImage[i + 1] << 8), sImage[i + 2]
+                                    | (sImage[i + 3] << 8), 0, NULL, 0 };
+                }
+                double tPageStart = nowMillis();
+                uint8_t tPageRetries = 0;
+                while (runRequests(sRequests, tCount) < 0) {
+                    if (tAddress == 0 || ++tPageRetries > TRANSFER_RETRIES) {
+                        tPageFailed = 1;
+                        break;
+                    }
+                    // The device may have written the page, if only the status of the last transfer was lost
+                    waitMillis(tWriteSleep + 1);
+                }
+                tRetries += tPageRetries;
+                if (tPageFailed) {
+                    break;
+                }
+                double tTransferEnd = nowMillis();
+                // With frame aligned SPM the halt ends before the start of frame (request frame + 1 + write time)
+                double tSleep = tWriteSleep + ((tFeatures & FEATURE_FRAME_ALIGNED_SPM) ? 1 : 0);
+                waitMillis(tSleep);
+                tPagesWritten++;
+                printf("page address=0x%04X ms=%.1f sleep_ms=%.1f transfers=%u retries=%u\n", tAddress,
+                        tTransferEnd - tPageStart, nowMillis() - tTransferEnd, tCount, tPageRetries);
+                if (!sQuiet) {
+                    fprintf(stderr, "\rWriting %u %%", (tPage + 1) * 100 / sPlanCount);
+                }
+            }
+            progress("%s\n", tPageFailed ? "" : " done");
+            tRetries += tPageFailed;
+        } while (tPageFailed && ++tUploads < UPLOAD_RETRIES);
+        if (tPageFailed) {
+            fprintf(stderr, "Upload failed\n");
+            return 1;
+        }
+    }
+
+    double tExitStart = nowMillis();
+    uint32_t tStagedCrc = crc32(&sImage[tPageSize], tStagedLength);
+    if (tStagedLength) {
+        // The device checks the staged bootloader and disconnects before it copies it
+        controlOut(CMD_SELF_UPDATE, tStagedCrc & 0xFFFF, tStagedCrc >> 16);
+    } else {
+        controlOut(CMD_EXIT, 0, 0); // the device may be gone before the status of the request is received
+    }
+    libusb_close(sHandle);
+    waitUntil(tExitStart + EXIT_TIMEOUT_MS, &sLeft);
+    if (!sLeft) {
+        if (tStagedLength) {
+            // selfUpdate() of firmware/main.c does not report which of its two checks failed
+            fprintf(stderr, "The device rejected the staged bootloader. Either its first %u bytes differ from the running "
+                    "bootloader, i.e. it is built for another part, BOOTLOADER_ADDRESS or crt1.S, or the staged bytes do not "
+                    "match CRC-32 0x%08X\n", getEraseUnitSize(tInfo, tPageSize), tStagedCrc);
+        } else {
+            fprintf(stderr, "Bootloader did not exit\n");
+        }
+        return 1;
+    }
+    if (tStagedLength) {
+        printf("update ms=%.1f crc=0x%08X\n", sLeftMillis - tExitStart, tStagedCrc);
+        progress("The new bootloader starts without a program, %s\n", "upload it again");
+    } else {
+        printf("exit ms=%.1f\n", sLeftMillis - tExitStart);
+    }
+    double tTotal = sLeftMillis - sArrivalMillis;
+    printf("total ms=%.1f bytes=%u bytes_per_s=%.0f retries=%u\n", tTotal, tImageBytes,
+            tPagesWritten * tPageSize * 1000.0 / tTotal, tRetries);
+    progress("Upload of %s done\n", argv[optind]);
+    libusb_unref_device(sDevice);
+    libusb_exit(sContext);
+    return 0;
+}
@@ -0,0 +1,519 @@
+/* Name: mnusbmon.c
+ * Project: Micronucleus upload analysis
+ *
+ * Analyses a capture of a real micronucleus upload, taken with the usbmon facility of the Linux kernel.
+ * Accepted are the text interface (cat /sys/kernel/debug/usb/usbmon/1u > upload.mon) and pcap or pcapng
+ * files of tcpdump, tshark or Wireshark (link types LINUX_USB and LINUX_USB_MMAPPED).
+ *
+ * The control transfers of the bootloader are decoded, the flash image written is reconstructed
+ * and the time of the upload is broken down into erase, pages, transfers and host sleeps.
+ * usbmon sees URBs, not packets. NAKs and retries of the host controller are only visible as
+ * transfers taking longer than SLOW_URB_US, failed transfers as completion with an error status.
+ *
+ * Usage: mnusbmon [-d bus.device] [-p] [-o image.hex] capture
+ *   -d  analyse this device, default is the first device with the micronucleus VID/PID or with micronucleus requests
+ *   -p  print a line for every page
+ *   -o  write the reconstructed image as Intel HEX file
+ *
+ * License: GNU GPL v2 (see License.txt)
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#define MICRONUCLEUS_VID    0x16D0
+#define MICRONUCLEUS_PID    0x0753
+#define SLOW_URB_US         3000.0  // a control transfer of a low speed device needs around 3 frames, longer ones were NAKed or repeated
+#define HOST_SLEEP_US       1000.0  // gaps between transfers which are longer are counted as host sleep, shorter ones as host overhead
+
+// Protocol, see firmware/main.c
+#define CMD_DEVICE_INFO     0
+#define CMD_TRANSFER_PAGE   1
+#define CMD_ERASE_APP       2
+#define CMD_WRITE_DATA      3
+#define CMD_EXIT            4
+#define CMD_COUNT           8
+
+static const char *sCommandNames[CMD_COUNT] = { "device info", "transfer page", "erase", "write data", "exit", "status",
+        "diagnostics", "trace" };
+
+#define LINKTYPE_USB_LINUX          189
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+#define URB_DATA_MAX    64
+
+typedef struct {
+    uint64_t tag;
+    double submitUs;
+    double completeUs;          // 0 if no completion was captured
+    uint16_t bus;
+    uint8_t device;
+    uint8_t setup[8];
+    int status;                 // completion status, negative errno of the kernel
+    int length;                 // bytes transferred
+    uint8_t data[URB_DATA_MAX]; // data of IN transfers as far as captured
+} urb_t;
+
+static urb_t *sUrbs;
+static uint32_t sUrbCount;
+static uint32_t sUrbSize;
+
+/*
+ * Stores the submission of a control transfer
+ */
+static void submitUrb(uint64_t aTag, double aMicros, uint16_t aBus, uint8_t aDevice, const uint8_t *aSetup) {
+    if (sUrbCount == sUrbSize) {
+        sUrbSize = sUrbSize ? sUrbSize * 2 : 1024;
+        sUrbs = realloc(sUrbs, sUrbSize * sizeof(urb_t));
+        if (!sUrbs) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+    }
+    urb_t *tUrb = &sUrbs[sUrbCount++];
+    memset(tUrb, 0, sizeof(urb_t));
+    tUrb->tag = aTag;
+    tUrb->submitUs = aMicros;
+    tUrb->bus = aBus;
+    tUrb->device = aDevice;
+    memcpy(tUrb->setup, aSetup, 8);
+}
+
+/*
+ * Stores the completion at the last open submission with the same tag
+ */
+static void completeUrb(uint64_t aTag, double aMicros, int aStatus, int aLength, const uint8_t *aData, int aDataLength) {
+    for (int32_t i = sUrbCount - 1; i >= 0; i--) {
+        urb_t *tUrb = &sUrbs[i];
+        if (tUrb->tag == aTag && tUrb->completeUs == 0) {
+            tUrb->completeUs = aMicros;
+            tUrb->status = aStatus;
+            tUrb->length = aLength;
+            if (aDataLength > URB_DATA_MAX) {
+                aDataLength = URB_DATA_MAX;
+            }
+            memcpy(tUrb->data, aData, aDataLength);
+            return;
+        }
+    }
+}
+
+/*
+ * Text interface, see Documentation/usb/usbmon.rst of the kernel, e.g.
+ * ffff8881038e3cc0 1871512345 S Ci:1:005:0 s c0 00 0000 0000 0006 6 <
+ * ffff8881038e3cc0 1871513321 C Ci:1:005:0 0 6 = 1a400440 930b
+ */
+static int readText(FILE *aFile) {
+    char tLine[1024];
+    double tLastStamp = 0;
+    double tWraps = 0;
+    while (fgets(tLine, sizeof(tLine), aFile)) {
+        char *tWords[32];
+        int tWordCount = 0;
+        for (char *tWord = strtok(tLine, " \t\r\n"); tWord && tWordCount < 32; tWord = strtok(NULL, " \t\r\n")) {
+            tWords[tWordCount++] = tWord;
+        }
+        if (tWordCount < 5 || tWords[3][0] != 'C' || (tWords[3][1] != 'i' && tWords[3][1] != 'o')) {
+            continue; // only control transfers
+        }
+        uint64_t tTag = strtoull(tWords[0], NULL, 16);
+        double tStamp = strtoul(tWords[1], NULL, 10);
+        if (tStamp < tLastStamp - 2147483648.0) {
+            tWraps += 4294967296.0; // 32 bit microseconds
+        }
+        tLastStamp = tStamp;
+        tStamp += tWraps;
+        // Address is Ci:bus:device:endpoint, the old format has no bus
+        unsigned tNumbers[3] = { 0, 0, 0 };
+        int tFields = sscanf(tWords[3] + 2, ":%u:%u:%u", &tNumbers[0], &tNumbers[1], &tNumbers[2]);
+        uint16_t tBus = (tFields == 3) ? tNumbers[0] : 0;
+        uint8_t tDevice = (tFields == 3) ? tNumbers[1] : tNumbers[0];
+        if (tWords[2][0] == 'S') {
+            if (tWordCount < 10 || strcmp(tWords[4], "s") != 0) {
+                continue;
+            }
+            uint8_t tSetup[8];
+            tSetup[0] = strtoul(tWords[5], NULL, 16);
+            tSetup[1] = strtoul(tWords[6], NULL, 16);
+            for (int i = 0; i < 3; i++) {
+                uint16_t tValue = strtoul(tWords[7 + i], NULL, 16);
+                tSetup[2 + 2 * i] = tValue & 0xFF;
+                tSetup[3 + 2 * i] = tValue >> 8;
+            }
+            submitUrb(tTag, tStamp, tBus, tDevice, tSetup);
+        } else if (tWords[2][0] == 'C' || tWords[2][0] == 'E') {
+            int tStatus = atoi(tWords[4]);
+            int tLength = (tWordCount > 5) ? atoi(tWords[5]) : 0;
+            uint8_t tData[URB_DATA_MAX];
+            int tDataLength = 0;
+            if (tWordCount > 6 && strcmp(tWords[6], "=") == 0) {
+                for (int i = 7; i < tWordCount; i++) {
+                    for (char *tHex = tWords[i]; tHex[0] && tHex[1] && tDataLength < URB_DATA_MAX; tHex += 2) {
+                        char tByte[3] = { tHex[0], tHex[1], 0 };
+                        tData[tDataLength++] = strtoul(tByte, NULL, 16);
+                    }
+                }
+            }
+            completeUrb(tTag, tStamp, tStatus, tLength, tData, tDataLength);
+        }
+    }
+    return 0;
+}
+
+static uint32_t get32(const uint8_t *aBytes, int aSwapped) {
+    if (aSwapped) {
+        return (aBytes[0] << 24) | (aBytes[1] << 16) | (aBytes[2] << 8) | aBytes[3];
+    }
+    return aBytes[0] | (aBytes[1] << 8) | (aBytes[2] << 16) | ((uint32_t) aBytes[3] << 24);
+}
+
+/*
+ * One packet of the binary interface, struct usbmon_packet of the kernel in little endian
+ */
+static void decodeBinary(const uint8_t *aPacket, uint32_t aLength, int aLinkType) {
+    uint32_t tHeaderLength = (aLinkType == LINKTYPE_USB_LINUX_MMAPPED) ? 64 : 48;
+    if (aLength < tHeaderLength || aPacket[9] != 2) {
+        return; // only control transfers
+    }
+    uint64_t tTag = get32(aPacket, 0) | ((uint64_t) get32(aPacket + 4, 0) << 32);
+    uint8_t tType = aPacket[8];
+    uint8_t tDevice = aPacket[11];
+    uint16_t tBus = aPacket[12] | (aPacket[13] << 8);
+    double tStamp = (get32(aPacket + 16, 0) | ((uint64_t) get32(aPacket + 20, 0) << 32)) * 1e6
+            + (int32_t) get32(aPacket + 24, 0);
+    int tStatus = (int32_t) get32(aPacket + 28, 0);
+    int tLength = get32(aPacket + 32, 0);
+    uint32_t tCaptured = get32(aPacket + 36, 0);
+    if (tCaptured > aLength - tHeaderLength) {
+        tCaptured = aLength - tHeaderLength;
+    }
+    if (tType == 'S') {
+        if (aPacket[14] == 0) { // setup flag 0 means the setup packet is present
+            submitUrb(tTag, tStamp, tBus, tDevice, aPacket + 40);
+        }
+    } else if (tType == 'C' || tType == 'E') {
+        completeUrb(tTag, tStamp, tStatus, tLength, aPacket + tHeaderLength, tCaptured);
+    }
+}
+
+static int readPcap(FILE *aFile) {
+    uint8_t tHeader[24];
+    if (fread(tHeader, 1, sizeof(tHeader), aFile) != sizeof(tHeader)) {
+        return -1;
+    }
+    uint32_t tMagic = get32(tHeader, 0);
+    int tSwapped = (tMagic == 0xD4C3B2A1 || tMagic == 0x4D3CB2A1);
+    int tLinkType = get32(tHeader + 20, tSwapped);
+    if (tLinkType != LINKTYPE_USB_LINUX && tLinkType != LINKTYPE_USB_LINUX_MMAPPED) {
+        fprintf(stderr, "Link type %d is not a usbmon capture\n", tLinkType);
+        return -1;
+    }
+    uint8_t tRecord[16];
+    static uint8_t sPacket[0x40000];
+    while (fread(tRecord, 1, sizeof(tRecord), aFile) == sizeof(tRecord)) {
+        uint32_t tCaptured = get32(tRecord + 8, tSwapped);
+        if (tCaptured > sizeof(sPacket) || fread(sPacket, 1, tCaptured, aFile) != tCaptured) {
+            break;
+        }
+        decodeBinary(sPacket, tCaptured, tLinkType);
+    }
+    return 0;
+}
+
+static int readPcapng(FILE *aFile) {
+    static uint8_t sBlock[0x40000];
+    int tLinkTypes[16] = { 0 };
+    int tInterfaces = 0;
+    uint8_t tHeader[8];
+    while (fread(tHeader, 1, sizeof(tHeader), aFile) == sizeof(tHeader)) {
+        uint32_t tType = get32(tHeader, 0);
+        uint32_t tLength = get32(tHeader + 4, 0);
+        if (tLength < 12 || tLength - 8 > sizeof(sBlock) || fread(sBlock, 1, tLength - 8, aFile) != tLength - 8) {
+            break;
+        }
+        if (tType == 1) { // interface description block
+            if (tInterfaces < 16) {
+                tLinkTypes[tInterfaces] = sBlock[0] | (sBlock[1] << 8);
+            }
+            tInterfaces++;
+        } else if (tType == 6) { // enhanced packet block
+            uint32_t tInterface = get32(sBlock, 0);
+            uint32_t tCaptured = get32(sBlock + 12, 0);
+            if (tInterface < 16 && tCaptured <= tLength - 28) {
+                decodeBinary(sBlock + 20, tCaptured, tLinkTypes[tInterface]);
+            }
+        }
+    }
+    return 0;
+}
+
+static void writeHexRecord(FILE *aFile, uint8_t aType, uint16_t aAddress, const uint8_t *aData, uint8_t aLength) {
+    uint8_t tSum = aLength + (aAddress >> 8) + (aAddress & 0xFF) + aType;
+    fprintf(aFile, ":%02X%04X%02X", aLength, aAddress, aType);
+    for (uint8_t i = 0; i < aLength; i++) {
+        fprintf(aFile, "%02X", aData[i]);
+        tSum += aData[i];
+    }
+    fprintf(aFile, "%02X\n", (uint8_t) -tSum);
+}
+
+static int writeHexFile(const char *aFileName, const uint8_t *aImage, const uint8_t *aWritten) {
+    FILE *tFile = fopen(aFileName, "w");
+    if (!tFile) {
+        perror(aFileName);
+        return -1;
+    }
+    for (uint32_t tAddress = 0; tAddress < 0x10000; tAddress += 16) {
+        uint8_t tLength = 0;
+        while (tLength < 16 && aWritten[tAddress + tLength]) {
+            tLength++;
+        }
+        if (tLength) {
+            writeHexRecord(tFile, 0, tAddress, &aImage[tAddress], tLength);
+        }
+    }
+    writeHexRecord(tFile, 1, 0, NULL, 0);
+    fclose(tFile);
+    return 0;
+}
+
+static uint16_t wordAt(const uint8_t *aSetup, uint8_t aOffset) {
+    return aSetup[aOffset] | (aSetup[aOffset + 1] << 8);
+}
+
+/*
+ * Selects the micronucleus device: the one which returned the micronucleus device descriptor,
+ * or else the first one with a vendor IN request 0 returning at least 6 bytes (cmd_device_info)
+ */
+static int findDevice(uint16_t *aBus, uint8_t *aDevice) {
+    for (uint32_t i = 0; i < sUrbCount; i++) {
+        urb_t *tUrb = &sUrbs[i];
+        if (tUrb->setup[0] == 0x80 && tUrb->setup[1] == 6 && tUrb->setup[3] == 1 && tUrb->length >= 12
+                && wordAt(tUrb->data, 8) == MICRONUCLEUS_VID && wordAt(tUrb->data, 10) == MICRONUCLEUS_PID) {
+            *aBus = tUrb->bus;
+            *aDevice = tUrb->device;
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < sUrbCount; i++) {
+        urb_t *tUrb = &sUrbs[i];
+        if (tUrb->setup[0] == 0xC0 && tUrb->setup[1] == CMD_DEVICE_INFO && tUrb->length >= 6) {
+            *aBus = tUrb->bus;
+            *aDevice = tUrb->device;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    int tOption;
+    int tSelectBus = -1, tSelectDevice = -1;
+    int tPrintPages = 0;
+    const char *tHexFileName = NULL;
+    while ((tOption = getopt(argc, argv, "d:po:")) != -1) {
+        switch (tOption) {
+        case 'd':
+            if (sscanf(optarg, "%d.%d", &tSelectBus, &tSelectDevice) != 2) {
+                tSelectBus = -2;
+            }
+            break;
+        case 'p':
+            tPrintPages = 1;
+            break;
+        case 'o':
+            tHexFileName = optarg;
+            break;
+        default:
+            tSelectBus = -2;
+            break;
+        }
+    }
+    if (tSelectBus == -2 || optind >= argc) {
+        fprintf(stderr, "Usage: %s [-d bus.device] [-p] [-o image.hex] capture\n", argv[0]);
+        return 2;
+    }
+    FILE *tFile = fopen(argv[optind], "rb");
+    if (!tFile) {
+        perror(argv[optind]);
+        return 2;
+    }
+    uint8_t tMagic[4];
+    if (fread(tMagic, 1, 4, tFile) != 4) {
+        fprintf(stderr, "%s is empty\n", argv[optind]);
+        return 2;
+    }
+    rewind(tFile);
+    uint32_t tMagicWord = get32(tMagic, 0);
+    int tResult;
+    if (tMagicWord == 0x0A0D0D0A) {
+        tResult = readPcapng(tFile);
+    } else if (tMagicWord == 0xA1B2C3D4 || tMagicWord == 0xD4C3B2A1 || tMagicWord == 0xA1B23C4D
+            || tMagicWord == 0x4D3CB2A1) {
+        tResult = readPcap(tFile);
+    } else {
+        tResult = readText(tFile);
+    }
+    fclose(tFile);
+    if (tResult < 0) {
+        return 2;
+    }
+
+    uint16_t tBus;
+    uint8_t tDevice;
+    if (tSelectBus >= 0) {
+        tBus = tSelectBus;
+        tDevice = tSelectDevice;
+    } else if (findDevice(&tBus, &tDevice) < 0) {
+        fprintf(stderr, "No micronucleus device found in %u control transfers\n", sUrbCount);
+        return 1;
+    }
+
+    /*
+     * Walk through the vendor requests of the device in the order of submission
+     */
+    static uint8_t sImage[0x10000];
+    static uint8_t sWritten[0x10000];
+    uint16_t tPageSize = 0;
+    uint32_t tAddress = 0;
+    uint32_t tRequests[CMD_COUNT] = { 0 };
+    uint32_t tErrors[CMD_COUNT] = { 0 };
+    uint32_t tSlow = 0, tBytes = 0, tPages = 0;
+    double tStartUs = -1, tExitUs = -1, tEraseUs = -1, tEraseWaitUs = 0;
+    double tTransferUs = 0, tSleepUs = 0, tOverheadUs = 0;
+    double tLastEndUs = -1;
+    // current page
+    double tPageStartUs = -1, tPageTransferUs = 0, tPageSleepUs = 0;
+    uint32_t tPageAddress = 0, tPageRequests = 0, tPageErrors = 0, tPageSlow = 0;
+
+    for (uint32_t i = 0; i <= sUrbCount; i++) {
+        urb_t *tUrb = (i < sUrbCount) ? &sUrbs[i] : NULL;
+        if (tUrb && (tUrb->bus != tBus || tUrb->device != tDevice || (tUrb->setup[0] & 0x60) != 0x40)) {
+            continue; // only vendor requests of our device
+        }
+        uint8_t tCommand = tUrb ? tUrb->setup[1] : CMD_EXIT;
+        // gap to the end of the previous request
+        if (tUrb && tLastEndUs >= 0 && tUrb->submitUs > tLastEndUs) {
+            double tGap = tUrb->submitUs - tLastEndUs;
+            if (tGap >= HOST_SLEEP_US) {
+                tSleepUs += tGap;
+                if (tPageStartUs >= 0) {
+                    tPageSleepUs += tGap;
+                }
+                if (tEraseUs >= 0 && tEraseWaitUs == 0) {
+                    tEraseWaitUs = tGap; // the host tool sleeps the erase time after the erase request
+                }
+            } else {
+                tOverheadUs += tGap;
+            }
+        }
+        if (tPageStartUs >= 0 && (!tUrb || tCommand != CMD_WRITE_DATA)) {
+            // end of the current page
+            double tEndUs = tUrb ? tUrb->submitUs : tLastEndUs;
+            if (tPrintPages) {
+                if (tPages == 1) {
+                    printf("  page    requests errors slow  transfer ms  sleep ms  total ms\n");
+                }
+                printf("  0x%04X  %8u %6u %4u %12.1f %9.1f %9.1f\n", tPageAddress, tPageRequests, tPageErrors, tPageSlow,
+                        tPageTransferUs / 1000, tPageSleepUs / 1000, (tEndUs - tPageStartUs) / 1000);
+            }
+            tPageStartUs = -1;
+        }
+        if (!tUrb) {
+            break;
+        }
+        if (tStartUs < 0) {
+            tStartUs = tUrb->submitUs;
+        }
+        double tDuration = (tUrb->completeUs > 0) ? tUrb->completeUs - tUrb->submitUs : 0;
+        tLastEndUs = (tUrb->completeUs > 0) ? tUrb->completeUs : tUrb->submitUs;
+        tTransferUs += tDuration;
+        if (tCommand < CMD_COUNT) {
+            tRequests[tCommand]++;
+        }
+        uint8_t tFailed = (tUrb->completeUs == 0 || tUrb->status < 0);
+        if (tFailed && tCommand < CMD_COUNT) {
+            tErrors[tCommand]++;
+        }
+        if (tDuration > SLOW_URB_US) {
+            tSlow++;
+        }
+
+        if (tCommand == CMD_DEVICE_INFO && tUrb->length >= 6 && !tFailed) {
+            tPageSize = tUrb->data[2] ? tUrb->data[2] : 256;
+            printf("Device %u.%u: flash %u bytes, page %u bytes, write sleep %u ms, signature %02X %02X",
+                    tBus, tDevice, (tUrb->data[0] << 8) | tUrb->data[1], tPageSize, tUrb->data[3] & 0x7F, tUrb->data[4],
+                    tUrb->data[5]);
+            if (tUrb->length > 6) {
+                printf(", features 0x%02X", tUrb->data[6]);
+            }
+            printf("\n");
+        } else if (tCommand == CMD_ERASE_APP) {
+            tEraseUs = tUrb->submitUs;
+            tEraseWaitUs = 0;
+            tAddress = 0; // the bootloader resets the address, page 0 must be written first
+        } else if (tCommand == CMD_TRANSFER_PAGE) {
+            if (!tFailed) {
+                if (tAddress != 0 && tPageSize) {
+                    tAddress = wordAt(tUrb->setup, 4) & ~(tPageSize - 1);
+                }
+                tPageStartUs = tUrb->submitUs;
+                tPageAddress = tAddress;
+                tPageTransferUs = tDuration;
+                tPageSleepUs = 0;
+                tPageRequests = 1;
+                tPageErrors = 0;
+                tPageSlow = (tDuration > SLOW_URB_US);
+                tPages++;
+            }
+        } else if (tCommand == CMD_WRITE_DATA) {
+            if (tPageStartUs >= 0) {
+                tPageTransferUs += tDuration;
+                tPageRequests++;
+                tPageErrors += tFailed;
+                tPageSlow += (tDuration > SLOW_URB_US);
+            }
+            if (!tFailed && tAddress + 4 <= sizeof(sImage)) {
+                for (uint8_t j = 0; j < 4; j++) {
+                    sImage[tAddress + j] = tUrb->setup[2 + j];
+                    sWritten[tAddress + j] = 1;
+                }
+                tAddress += 4;
+                tBytes += 4;
+            }
+        } else if (tCommand == CMD_EXIT && tExitUs < 0) {
+            tExitUs = tUrb->submitUs;
+        }
+    }
+    if (tStartUs < 0) {
+        fprintf(stderr, "No micronucleus requests of device %u.%u found\n", tBus, tDevice);
+        return 1;
+    }
+
+    double tEndUs = (tExitUs >= 0) ? tExitUs : tLastEndUs;
+    double tTotalUs = tEndUs - tStartUs;
+    printf("Requests:");
+    for (uint8_t i = 0; i < CMD_COUNT; i++) {
+        if (tRequests[i]) {
+            printf(" %u %s%s", tRequests[i], sCommandNames[i], (tErrors[i] ? "" : ","));
+            if (tErrors[i]) {
+                printf(" (%u failed),", tErrors[i]);
+            }
+        }
+    }
+    printf(" %u slower than %.0f ms\n", tSlow, SLOW_URB_US / 1000);
+    if (tEraseUs >= 0) {
+        printf("Erase: host waited %.1f ms\n", tEraseWaitUs / 1000);
+    }
+    printf("Pages: %u, %u bytes written\n", tPages, tBytes);
+    printf("Time: transfers %.1f ms, host sleeps %.1f ms, host overhead %.1f ms, total %.1f ms\n", tTransferUs / 1000,
+            tSleepUs / 1000, tOverheadUs / 1000, tTotalUs / 1000);
+    if (tTotalUs > 0) {
+        printf("Effective rate: %.0f bytes/s%s\n", tBytes * 1e6 / tTotalUs, (tExitUs < 0) ? " (no exit request captured)" : "");
+    }
+    if (tHexFileName && writeHexFile(tHexFileName, sImage, sWritten) < 0) {
+        return 2;
+    }
+    return 0;
+}